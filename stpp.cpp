@@ -1,16 +1,88 @@
+#include "stpp.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+// Windows must be included first
+#include <fcntl.h>
+#include <io.h>
+#include <psapi.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Everything but the library interface has internal linkage.
+// Code only the command line uses is left out of the library build (STPP_LIBRARY)
+namespace {
+#ifndef STPP_LIBRARY
 static void usage()
 {
     std::cout << "stpp [options] in out \n"
               << "Available options:\n"
               << "    -h     --help                Shows this message\n"
               << "    -D     --definition          Define a tag\n"
+              << "    -p     --profile             Write the anonymized shape profile of the input instead\n"
+              << "    -g     --generate            Generate a synthetic input from the given shape profile\n"
+              << "           --seed                Seed used to generate synthetic inputs\n"
+              << "    -s     --stats               Print memory and evaluation statistics to the error stream\n"
+              << "    -t     --tar                 Input and output are tar archives, every regular file is preprocessed\n"
+              << "    -j     --jobs                Number of files preprocessed in parallel in tar mode, limited by a make jobserver if any\n"
+              << "           --diff                Only write lines differing between the tags before and after --against\n"
+              << "           --against             Following tags define the configuration to compare against\n"
+              << "    -i     --index               Update the given reverse index with the tags referenced by each input\n"
+              << "    -q     --query               Print all files in the reverse index referencing the given tag\n"
+              << "    -a     --annotations         Write the location of all #[name] annotations in the output to the given file\n"
+              << "    -c     --compile             Write a compiled template, rendered for any tags by the library without preprocessing again\n"
+              << "           --drop-cache          Drop input and output files from the page cache while preprocessing\n"
+              << "           --record-io           Record all reads and writes of the input and output to the given trace. Forces stream\n"
+              << "                                 mode: the input is read instead of mapped and all I/O is issued in 64 KiB chunks\n"
+              << "           --replay-io           Replay the given trace against the input and output, taking as long as recorded\n"
+              << "           --bench               Benchmark scanning and preprocessing the input with the given amount of runs.\n"
+              << "                                 Tar archives are processed in batch mode at doubling thread counts instead\n"
+              << "           --warmup              Runs before measuring a benchmark, defaults to three\n"
+              << "           --pin                 Pin benchmarks to the given CPU\n"
+              << "           --baseline            Compare benchmarks against the given baseline, failing on significant regressions above 2%\n"
+              << "           --save-baseline       Save the benchmark results as baseline to the given file\n"
+              << "           --max-time            Abort a file after the given amount of seconds\n"
+              << "           --max-output          Abort a file if its output exceeds the given amount of bytes\n"
+              << "           --max-depth           Abort a file if blocks are nested deeper than given\n"
+              << "           --max-expression      Abort a file if a condition is longer than the given amount of bytes\n"
               << std::flush;
 }
 
@@ -23,14 +95,54 @@ static bool check_option(int i, int argc, char** argv)
     return true;
 }
 
+enum class RunMode {
+    Preprocess,
+    Profile,
+    Generate,
+    Archive,
+    Query,
+    Diff,
+    Compile,
+    Replay,
+    Bench
+};
+#endif
+
+// Limits per file, checked at directive boundaries. Zero disables a limit
+struct Budget {
+    double Time       = 0;
+    size_t Output     = 0;
+    size_t Depth      = 0;
+    size_t Expression = 0;
+};
+
+#ifndef STPP_LIBRARY
 struct Options {
     std::string Input;
     std::string Output;
     std::unordered_set<std::string> Tags;
+    std::unordered_set<std::string> AgainstTags; // Second configuration in diff mode
+    RunMode Mode  = RunMode::Preprocess;
+    uint32_t Seed = 42;
+    bool Stats    = false;
+    size_t Jobs   = 0; // Zero uses all available cores
+    Budget Limits;
+    std::string IndexFile;
+    std::vector<std::string> Queries;
+    std::string AnnotationFile;
+    bool DropCache = false; // Keeps shared build machines from evicting the working set of other processes
+    std::string RecordFile;
+    std::string ReplayFile;
+    size_t BenchRuns   = 0;
+    size_t BenchWarmup = 3;
+    int BenchCpu       = -1; // Not pinned
+    std::string BaselineFile;
+    std::string SaveBaselineFile;
 };
 
 bool parse_arguments(int argc, char** argv, Options& options, bool& help)
 {
+    bool against = false;
     for (int i = 1; i < argc; ++i) {
         if (argv[i][0] == '-') {
             if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
@@ -41,7 +153,94 @@ bool parse_arguments(int argc, char** argv, Options& options, bool& help)
                 if (!check_option(i++, argc, argv))
                     return false;
                 std::string tag = argv[i];
-                options.Tags.insert(tag);
+                if (against)
+                    options.AgainstTags.insert(tag);
+                else
+                    options.Tags.insert(tag);
+            } else if (!strcmp(argv[i], "--diff")) {
+                options.Mode = RunMode::Diff;
+            } else if (!strcmp(argv[i], "--against")) {
+                options.Mode = RunMode::Diff;
+                against      = true;
+            } else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--profile")) {
+                options.Mode = RunMode::Profile;
+            } else if (!strcmp(argv[i], "-g") || !strcmp(argv[i], "--generate")) {
+                options.Mode = RunMode::Generate;
+            } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stats")) {
+                options.Stats = true;
+            } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--tar")) {
+                options.Mode = RunMode::Archive;
+            } else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.Jobs = std::strtoul(argv[i], nullptr, 10);
+            } else if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--index")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.IndexFile = argv[i];
+            } else if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--query")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.Mode = RunMode::Query;
+                options.Queries.emplace_back(argv[i]);
+            } else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--annotations")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.AnnotationFile = argv[i];
+            } else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--compile")) {
+                options.Mode = RunMode::Compile;
+            } else if (!strcmp(argv[i], "--bench")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.Mode      = RunMode::Bench;
+                options.BenchRuns = std::strtoull(argv[i], nullptr, 10);
+            } else if (!strcmp(argv[i], "--warmup")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.BenchWarmup = std::strtoull(argv[i], nullptr, 10);
+            } else if (!strcmp(argv[i], "--pin")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.BenchCpu = std::atoi(argv[i]);
+            } else if (!strcmp(argv[i], "--baseline")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.BaselineFile = argv[i];
+            } else if (!strcmp(argv[i], "--save-baseline")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.SaveBaselineFile = argv[i];
+            } else if (!strcmp(argv[i], "--max-time")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.Limits.Time = std::strtod(argv[i], nullptr);
+            } else if (!strcmp(argv[i], "--max-output")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.Limits.Output = std::strtoull(argv[i], nullptr, 10);
+            } else if (!strcmp(argv[i], "--max-depth")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.Limits.Depth = std::strtoull(argv[i], nullptr, 10);
+            } else if (!strcmp(argv[i], "--max-expression")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.Limits.Expression = std::strtoull(argv[i], nullptr, 10);
+            } else if (!strcmp(argv[i], "--drop-cache")) {
+                options.DropCache = true;
+            } else if (!strcmp(argv[i], "--record-io")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.RecordFile = argv[i];
+            } else if (!strcmp(argv[i], "--replay-io")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.Mode       = RunMode::Replay;
+                options.ReplayFile = argv[i];
+            } else if (!strcmp(argv[i], "--seed")) {
+                if (!check_option(i++, argc, argv))
+                    return false;
+                options.Seed = static_cast<uint32_t>(std::strtoul(argv[i], nullptr, 10));
             } else {
                 std::cerr << "Unknown option '" << argv[i] << "'. Aborting." << std::endl;
                 return false;
@@ -63,28 +262,398 @@ bool parse_arguments(int argc, char** argv, Options& options, bool& help)
 
 std::istream& open_input_stream(const Options& opts)
 {
-    if (opts.Input.empty() || opts.Input == "--")
+    const bool binary = opts.Mode == RunMode::Archive || opts.Mode == RunMode::Replay;
+    if (opts.Input.empty() || opts.Input == "--") {
+#if defined(_WIN32)
+        if (binary)
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
         return std::cin;
-    else {
+    } else {
         static std::unique_ptr<std::ifstream> stream;
-        stream = std::make_unique<std::ifstream>(opts.Input);
+        stream = std::make_unique<std::ifstream>(opts.Input, binary ? std::ios::in | std::ios::binary : std::ios::in);
         return *stream;
     }
 }
 
 std::ostream& open_output_stream(const Options& opts)
 {
-    if (opts.Output.empty() || opts.Output == "--")
+    const bool binary = opts.Mode == RunMode::Archive || opts.Mode == RunMode::Compile || opts.Mode == RunMode::Replay;
+    if (opts.Output.empty() || opts.Output == "--") {
+#if defined(_WIN32)
+        if (binary)
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
         return std::cout;
-    else {
+    } else {
         static std::unique_ptr<std::ofstream> stream;
-        stream = std::make_unique<std::ofstream>(opts.Output);
+        stream = std::make_unique<std::ofstream>(opts.Output, binary ? std::ios::out | std::ios::binary : std::ios::out);
         return *stream;
     }
 }
+#endif
+
+// Read only mapping of a whole regular file.
+// Files are only mapped on POSIX systems, as text mode streams on Windows translate line endings
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path)
+    {
+#if defined(_WIN32)
+        (void)path;
+        return false;
+#else
+        if (path.empty() || path == "--")
+            return false;
+
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        bool good = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+        if (good && info.st_size > 0) {
+            void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            good       = data != MAP_FAILED;
+            if (good) {
+                mData = data;
+                mSize = static_cast<size_t>(info.st_size);
+                madvise(mData, mSize, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+
+        mOpen = good;
+        return good;
+#endif
+    }
+
+    void close()
+    {
+#if !defined(_WIN32)
+        if (mData)
+            munmap(mData, mSize);
+#endif
+        mData = nullptr;
+        mSize = 0;
+        mOpen = false;
+    }
+
+    inline bool isOpen() const { return mOpen; }
+    inline std::string_view view() const { return std::string_view(static_cast<const char*>(mData), mSize); }
+
+private:
+    void* mData = nullptr;
+    size_t mSize = 0;
+    bool mOpen   = false;
+};
+
+#ifndef STPP_LIBRARY
+constexpr uint64_t DROP_CACHE_CHUNK = 8 << 20;
+
+// Drops the pages of a file from the page cache, after writing them back if the file was written.
+// Pages still mapped by any process stay cached
+void drop_page_cache(const std::string& path, bool written)
+{
+#if defined(_WIN32)
+    (void)path;
+    (void)written;
+#else
+    if (path.empty() || path == "--")
+        return;
+
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    if (written)
+        fsync(fd); // Only clean pages can be dropped
+#if defined(POSIX_FADV_DONTNEED)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    ::close(fd);
+#endif
+}
+
+// Drops a file from the page cache chunk by chunk while it is read or written, instead of all at once when done.
+// Writeback of a written chunk is started right away and waited for one chunk later, such that it overlaps with
+// preprocessing. Consumed parts of a mapped input are unmapped first, as mapped pages can not be dropped
+class CacheDropper {
+public:
+    CacheDropper(const std::string& path, bool written, const char* mapping = nullptr)
+        : mWritten(written)
+        , mMapping(mapping)
+    {
+#if !defined(_WIN32)
+        if (!path.empty() && path != "--")
+            mFd = ::open(path.c_str(), O_RDONLY);
+#else
+        (void)path;
+#endif
+    }
+
+    CacheDropper(const CacheDropper&) = delete;
+    CacheDropper& operator=(const CacheDropper&) = delete;
+
+    ~CacheDropper()
+    {
+#if !defined(_WIN32)
+        if (mFd >= 0)
+            ::close(mFd);
+#endif
+    }
+
+    // Position is the amount of bytes read or written so far. Written data has to be flushed to the file already
+    void advance(uint64_t position)
+    {
+#if !defined(_WIN32)
+        const uint64_t end = position / DROP_CACHE_CHUNK * DROP_CACHE_CHUNK;
+        if (mFd < 0 || end <= mStarted)
+            return;
+
+        if (mWritten) {
+            // Only clean pages can be dropped
+#if defined(SYNC_FILE_RANGE_WRITE)
+            sync_file_range(mFd, static_cast<off_t>(mStarted), static_cast<off_t>(end - mStarted), SYNC_FILE_RANGE_WRITE);
+            if (mStarted > mDropped) {
+                sync_file_range(mFd, static_cast<off_t>(mDropped), static_cast<off_t>(mStarted - mDropped),
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                drop(mStarted);
+            }
+#else
+            fdatasync(mFd);
+            drop(end);
+#endif
+        } else {
+            if (mMapping)
+                madvise(const_cast<char*>(mMapping) + mDropped, end - mDropped, MADV_DONTNEED);
+            drop(end);
+        }
+        mStarted = end;
+#else
+        (void)position;
+#endif
+    }
+
+private:
+    void drop(uint64_t end)
+    {
+#if defined(POSIX_FADV_DONTNEED)
+        posix_fadvise(mFd, static_cast<off_t>(mDropped), static_cast<off_t>(end - mDropped), POSIX_FADV_DONTNEED);
+#endif
+        mDropped = end;
+    }
+
+    int mFd = -1;
+    bool mWritten;
+    const char* mMapping;
+    uint64_t mStarted = 0; // Writeback started up to here
+    uint64_t mDropped = 0;
+};
+
+// I/O traces
+// Records every read and write of the input and output streams with its offset, size and duration, such that the I/O
+// pattern of a run can be replayed against local files later. Written as one "op<TAB>offset<TAB>size<TAB>microseconds"
+// line per operation, with "r" for reads, "w" for writes and "s" for seeks of the input.
+// Recording forces stream mode: inputs are never mapped, and all I/O is rechunked into IO_TRACE_BUFFER_SIZE calls to
+// the underlying buffers. A trace thus describes a streamed run, not the mapped one taken without recording.
+constexpr const char* IO_TRACE_HEADER = "stpp-io 1";
+constexpr size_t IO_TRACE_BUFFER_SIZE = 64 * 1024;
+
+struct IoRecord {
+    char Op         = 'r';
+    uint64_t Offset = 0;
+    uint64_t Size   = 0;
+    uint64_t Micros = 0;
+};
+
+// Forwards to another buffer in chunks, recording each of them
+class TracedStreambuf : public std::streambuf {
+public:
+    TracedStreambuf(std::streambuf* target, bool input, std::vector<IoRecord>& records)
+        : mTarget(target)
+        , mInput(input)
+        , mRecords(records)
+    {
+        if (!mInput) {
+            setp(mBuffer, mBuffer + IO_TRACE_BUFFER_SIZE);
+        } else {
+            const pos_type start = mTarget->pubseekoff(0, std::ios_base::cur, std::ios_base::in);
+            mSeekable            = start != pos_type(off_type(-1));
+            mOffset              = mSeekable ? static_cast<uint64_t>(off_type(start)) : 0;
+        }
+    }
+
+    inline std::streambuf* target() const { return mTarget; }
+
+protected:
+    int_type underflow() override
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+
+        const auto start          = std::chrono::steady_clock::now();
+        const std::streamsize got = mTarget->sgetn(mBuffer, IO_TRACE_BUFFER_SIZE);
+        if (got <= 0)
+            return traits_type::eof();
+
+        record('r', static_cast<uint64_t>(got), start);
+        setg(mBuffer, mBuffer, mBuffer + got);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int_type overflow(int_type c) override
+    {
+        if (!flush())
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override
+    {
+        if (mInput)
+            return 0;
+        return flush() && mTarget->pubsync() == 0 ? 0 : -1;
+    }
+
+    // Only the input is seeked, by the directive scan
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+    {
+        if (!mInput)
+            return pos_type(off_type(-1));
+
+        // Position queries (tellg) are answered from the buffer, they neither seek nor show up in the trace
+        if (off == 0 && dir == std::ios_base::cur)
+            return mSeekable ? pos_type(off_type(mOffset) - (egptr() - gptr())) : pos_type(off_type(-1));
+
+        if (dir == std::ios_base::cur)
+            off -= egptr() - gptr(); // Still buffered
+        setg(mBuffer, mBuffer, mBuffer);
+
+        const auto start   = std::chrono::steady_clock::now();
+        const pos_type pos = mTarget->pubseekoff(off, dir, which);
+        if (pos != pos_type(off_type(-1))) {
+            mOffset = static_cast<uint64_t>(off_type(pos));
+            record('s', 0, start);
+        }
+        return pos;
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override { return seekoff(off_type(pos), std::ios_base::beg, which); }
+
+private:
+    bool flush()
+    {
+        const std::streamsize size = pptr() - pbase();
+        if (size == 0)
+            return true;
+
+        const auto start              = std::chrono::steady_clock::now();
+        const std::streamsize written = mTarget->sputn(pbase(), size);
+        record('w', static_cast<uint64_t>(written), start);
+        setp(mBuffer, mBuffer + IO_TRACE_BUFFER_SIZE);
+        return written == size;
+    }
+
+    // Keeps one byte for overflow()
+    void setp(char* begin, char* end) { std::streambuf::setp(begin, end - 1); }
+
+    void record(char op, uint64_t size, std::chrono::steady_clock::time_point start)
+    {
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        mRecords.push_back(IoRecord{ op, mOffset, size, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()) });
+        mOffset += size;
+    }
 
-bool parse(std::istream& in, std::ostream& out, const Options& options);
+    std::streambuf* mTarget;
+    bool mInput;
+    std::vector<IoRecord>& mRecords;
+    uint64_t mOffset = 0;
+    bool mSeekable   = false; // Of the input
+    char mBuffer[IO_TRACE_BUFFER_SIZE];
+};
+
+// Traces the given streams until finished, restoring their buffers either way
+class IoRecorder {
+public:
+    IoRecorder(std::istream& in, std::ostream& out)
+        : mIn(in)
+        , mOut(out)
+        , mInBuffer(in.rdbuf(), true, mRecords)
+        , mOutBuffer(out.rdbuf(), false, mRecords)
+    {
+        mIn.rdbuf(&mInBuffer);
+        mOut.rdbuf(&mOutBuffer);
+    }
+
+    IoRecorder(const IoRecorder&) = delete;
+    IoRecorder& operator=(const IoRecorder&) = delete;
+
+    ~IoRecorder() { restore(); }
+
+    bool finish(const std::string& path)
+    {
+        restore();
+
+        std::ofstream trace(path);
+        trace << IO_TRACE_HEADER << "\n";
+        for (const auto& record : mRecords)
+            trace << record.Op << "\t" << record.Offset << "\t" << record.Size << "\t" << record.Micros << "\n";
+
+        if (!trace.good()) {
+            std::cerr << "Could not write I/O trace '" << path << "'" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    void restore()
+    {
+        if (mOut.rdbuf() == &mOutBuffer) {
+            mOut.flush();
+            mOut.rdbuf(mOutBuffer.target());
+        }
+        if (mIn.rdbuf() == &mInBuffer)
+            mIn.rdbuf(mInBuffer.target());
+    }
+
+    std::istream& mIn;
+    std::ostream& mOut;
+    std::vector<IoRecord> mRecords;
+    TracedStreambuf mInBuffer;
+    TracedStreambuf mOutBuffer;
+};
+
+bool parse(std::istream& in, std::ostream& out, const Options& options, std::unordered_set<std::string>* referencedTags = nullptr, std::vector<stpp::Annotation>* annotations = nullptr);
+// Mapped tells that the input is the mapping of options.Input, such that it can be dropped from the page cache
+bool parse(std::string_view input, std::ostream& out, const Options& options, std::unordered_set<std::string>* referencedTags = nullptr, std::vector<stpp::Annotation>* annotations = nullptr,
+           bool mapped = false);
+bool profile(std::istream& in, std::ostream& out);
+bool generate(std::istream& in, std::ostream& out, uint32_t seed);
+bool archive(std::istream& in, std::ostream& out, const Options& options);
+
+using IndexUpdate = std::vector<std::pair<std::string, std::unordered_set<std::string>>>; // File and referenced tags
+bool update_index(const std::string& path, const IndexUpdate& update);
+bool query_index(const std::string& path, const std::vector<std::string>& tags, std::ostream& out);
+bool write_annotations(const std::string& path, const std::vector<stpp::Annotation>& annotations);
+bool compile(std::string_view input, std::ostream& out);
+bool replay_io(const std::string& path, std::istream& in, std::ostream& out);
+bool benchmark(std::string_view input, std::ostream& out, const Options& options);
+#endif
+} // namespace
 
+#if !defined(STPP_LIBRARY) && !defined(STPP_TESTS)
 int main(int argc, char** argv)
 {
     bool help = false;
@@ -94,6 +663,20 @@ int main(int argc, char** argv)
     if (help)
         return EXIT_SUCCESS;
 
+    if (options.Mode == RunMode::Query) {
+        if (options.IndexFile.empty()) {
+            std::cerr << "Querying requires an index file. Aborting." << std::endl;
+            return EXIT_FAILURE;
+        }
+        return query_index(options.IndexFile, options.Queries, std::cout) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    const bool annotate = !options.AnnotationFile.empty();
+    if (annotate && options.Mode != RunMode::Preprocess) {
+        std::cerr << "Annotations are only available when preprocessing a single file. Aborting." << std::endl;
+        return EXIT_FAILURE;
+    }
+
     std::istream& in = open_input_stream(options);
     if (!in.good()) {
         std::cerr << "Could not open input stream. Aborting." << std::endl;
@@ -106,12 +689,88 @@ int main(int argc, char** argv)
         return EXIT_FAILURE;
     }
 
-    if (!parse(in, out, options))
-        return EXIT_SUCCESS;
+    // Regular files are preprocessed straight from a mapping instead of the stream if possible.
+    // Recording needs every read to go through the stream, so it always runs in stream mode
+    const bool record = !options.RecordFile.empty();
+    MappedFile mapped;
+    if (!record && (options.Mode == RunMode::Preprocess || options.Mode == RunMode::Diff || options.Mode == RunMode::Compile || options.Mode == RunMode::Bench))
+        mapped.open(options.Input);
+
+    std::unique_ptr<IoRecorder> recorder;
+    if (record && options.Mode != RunMode::Replay)
+        recorder = std::make_unique<IoRecorder>(in, out);
+
+    switch (options.Mode) {
+    case RunMode::Profile:
+        if (!profile(in, out))
+            return EXIT_FAILURE;
+        break;
+    case RunMode::Generate:
+        if (!generate(in, out, options.Seed))
+            return EXIT_FAILURE;
+        break;
+    case RunMode::Archive:
+        if (!archive(in, out, options))
+            return EXIT_FAILURE;
+        break;
+    case RunMode::Replay:
+        if (!replay_io(options.ReplayFile, in, out))
+            return EXIT_FAILURE;
+        break;
+    case RunMode::Compile:
+    case RunMode::Bench: {
+        // Literals are copied into the template and benchmarks run repeatedly, so the whole input is needed anyway
+        std::string buffer;
+        if (!mapped.isOpen()) {
+            std::ostringstream stream;
+            stream << in.rdbuf();
+            buffer = stream.str();
+        }
+        const std::string_view input = mapped.isOpen() ? mapped.view() : std::string_view(buffer);
+        if (!(options.Mode == RunMode::Compile ? compile(input, out) : benchmark(input, out, options)))
+            return EXIT_FAILURE;
+    } break;
+    case RunMode::Diff:
+        if (!(mapped.isOpen() ? parse(mapped.view(), out, options, nullptr, nullptr, true) : parse(in, out, options)))
+            return EXIT_FAILURE;
+        break;
+    default:
+    case RunMode::Preprocess: {
+        const bool index = !options.IndexFile.empty();
+        if (index && (options.Input.empty() || options.Input == "--")) {
+            std::cerr << "Can not index the standard input. Aborting." << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        IndexUpdate update(1);
+        update[0].first = options.Input;
+        std::vector<stpp::Annotation> annotations;
+        std::unordered_set<std::string>* referencedTags = index ? &update[0].second : nullptr;
+        std::vector<stpp::Annotation>* annotationsPtr   = annotate ? &annotations : nullptr;
+        if (!(mapped.isOpen() ? parse(mapped.view(), out, options, referencedTags, annotationsPtr, true) : parse(in, out, options, referencedTags, annotationsPtr)))
+            return EXIT_FAILURE;
+        if (index && !update_index(options.IndexFile, update))
+            return EXIT_FAILURE;
+        if (annotate && !write_annotations(options.AnnotationFile, annotations))
+            return EXIT_FAILURE;
+    } break;
+    }
+
+    if (recorder && !recorder->finish(options.RecordFile))
+        return EXIT_FAILURE;
+
+    if (options.DropCache) {
+        mapped.close();
+        out.flush();
+        drop_page_cache(options.Input, false);
+        drop_page_cache(options.Output, true);
+    }
 
     return EXIT_SUCCESS;
 }
+#endif
 
+namespace {
 constexpr char PP_START = '#';
 
 enum class Operation {
@@ -121,18 +780,118 @@ enum class Operation {
     Endif,
     Define,
     Undef,
-    Unknown
+    Unknown,
+    Custom // Registered through the library interface, never part of profiles
+};
+constexpr size_t MAX_OPERATION_SIZE = 16;
+constexpr const char* BUILTIN_DIRECTIVES[] = { "if", "elif", "else", "endif", "define", "undef" };
+constexpr size_t BUILTIN_DIRECTIVE_COUNT   = sizeof(BUILTIN_DIRECTIVES) / sizeof(BUILTIN_DIRECTIVES[0]);
+
+// Directive keywords are dispatched through a perfect hash table, built once when keywords are added.
+// The seed and size are searched until no two keywords share a slot, so a lookup is a single hash and compare.
+class DirectiveTable {
+public:
+    DirectiveTable()
+    {
+        for (const char* keyword : BUILTIN_DIRECTIVES)
+            mKeywords.emplace_back(keyword);
+        build();
+    }
+
+    // Keywords beyond the builtin ones are custom directives, indexed in the order of registration
+    bool add(std::string_view keyword)
+    {
+        size_t custom;
+        if (keyword.empty() || keyword.size() > MAX_OPERATION_SIZE || find(keyword, custom) != Operation::Unknown)
+            return false;
+
+        mKeywords.emplace_back(keyword);
+        build();
+        return true;
+    }
+
+    inline Operation find(std::string_view name, size_t& custom) const
+    {
+        const uint32_t index = mSlots[hash(name, mSeed) & (mSlots.size() - 1)];
+        if (index == EMPTY || mKeywords[index] != name)
+            return Operation::Unknown;
+
+        if (index < BUILTIN_DIRECTIVE_COUNT)
+            return static_cast<Operation>(index);
+
+        custom = index - BUILTIN_DIRECTIVE_COUNT;
+        return Operation::Custom;
+    }
+
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    static inline uint32_t hash(std::string_view name, uint32_t seed)
+    {
+        uint32_t value = 2166136261u ^ seed; // FNV-1a
+        for (char c : name)
+            value = (value ^ static_cast<uint8_t>(c)) * 16777619u;
+        return value;
+    }
+
+    void build()
+    {
+        size_t size = 1;
+        while (size < mKeywords.size() * 2)
+            size *= 2;
+
+        for (;; size *= 2) {
+            for (uint32_t seed = 0; seed < 256; ++seed) {
+                if (tryBuild(size, seed)) {
+                    mSeed = seed;
+                    return;
+                }
+            }
+        }
+    }
+
+    bool tryBuild(size_t size, uint32_t seed)
+    {
+        mSlots.assign(size, EMPTY);
+        for (size_t i = 0; i < mKeywords.size(); ++i) {
+            uint32_t& slot = mSlots[hash(mKeywords[i], seed) & (size - 1)];
+            if (slot != EMPTY)
+                return false;
+            slot = static_cast<uint32_t>(i);
+        }
+        return true;
+    }
+
+    std::vector<std::string> mKeywords;
+    std::vector<uint32_t> mSlots;
+    uint32_t mSeed = 0;
 };
-Operation extract_operation(std::istream& in, const char*& name)
+
+const DirectiveTable& builtin_directives()
+{
+    static const DirectiveTable table;
+    return table;
+}
+
+Operation to_operation(std::string_view name)
 {
-    constexpr size_t MAX_BUF_SIZE = 16;
-    static char buffer[MAX_BUF_SIZE + 1];
+    size_t custom;
+    const Operation op = builtin_directives().find(name, custom);
+    return op == Operation::Custom ? Operation::Unknown : op;
+}
+
+template <typename Source>
+Operation extract_operation(Source& in, const DirectiveTable& directives, const char*& name, size_t& custom, bool& lineEnd)
+{
+    static thread_local char buffer[MAX_OPERATION_SIZE + 1];
 
     size_t counter = 0;
     bool started   = false;
     char c;
-    while (counter < MAX_BUF_SIZE && in.get(c)) {
-        if (c == '\n')
+    lineEnd = false;
+    while (counter < MAX_OPERATION_SIZE && in.get(c)) {
+        lineEnd = c == '\n';
+        if (lineEnd)
             break;
         if (!std::isspace(c)) {
             buffer[counter++] = c;
@@ -145,23 +904,7 @@ Operation extract_operation(std::istream& in, const char*& name)
     buffer[counter] = 0;
     name            = buffer;
 
-    if (strcmp("if", buffer) == 0)
-        return Operation::If;
-    else if (strcmp("elif", buffer) == 0)
-        return Operation::Elif;
-    else if (strcmp("else", buffer) == 0)
-        return Operation::Else;
-    else if (strcmp("endif", buffer) == 0)
-        return Operation::Endif;
-    else if (strcmp("define", buffer) == 0)
-        return Operation::Define;
-    else if (strcmp("undef", buffer) == 0)
-        return Operation::Undef;
-    else {
-        // Silently ignore
-        //std::cerr << "Got unknown operation " << buffer << std::endl;
-        return Operation::Unknown;
-    }
+    return directives.find(std::string_view(buffer, counter), custom);
 }
 
 inline bool is_eof(std::istream& in)
@@ -170,346 +913,3541 @@ inline bool is_eof(std::istream& in)
     return in.get(c).eof() || c == '\n';
 }
 
-struct Context {
-    std::unordered_set<std::string> Tags;
-    size_t Depth = 0;
-};
-
-bool handle_if(std::istream& in, std::ostream& out, Context& ctx, bool ignore);
-bool handle_define(std::istream& in, Context& ctx);
-bool handle_undef(std::istream& in, Context& ctx);
-
-bool consume(std::istream& in, std::ostream& out, Context& context, bool ignore)
-{
-    char c;
-    while (in.get(c)) {
-        if (c == PP_START) {
-            const char* name;
-            const Operation op = extract_operation(in, name);
-            switch (op) {
-            case Operation::If:
-                if (!handle_if(in, out, context, ignore))
-                    return false;
-                break;
-            case Operation::Define:
-                if (!ignore && !handle_define(in, context))
-                    return false;
-                break;
-            case Operation::Undef:
-                if (!ignore && !handle_undef(in, context))
-                    return false;
-                break;
-            default:
-            case Operation::Unknown:
-                if (!ignore) {
-                    out.put(PP_START);
-                    out.write(name, strlen(name));// FIXME: We lose the whitespaces....
-                }
-            }
-        } else if (!ignore) {
-            out.put(c);
-        }
-    }
-    return true;
-}
-
-bool consume_next(std::istream& in, std::ostream& out, Context& context, bool ignore, Operation& next)
+// Memory accounting
+// Sizes are estimates of the heap usage of each structure, computed on request only.
+inline size_t string_usage(const std::string& str)
 {
-    char c;
-    while (in.get(c)) {
-        if (c == PP_START) {
-            const char* name;
-            const Operation op = extract_operation(in, name);
-            switch (op) {
-            case Operation::If:
-                if (!handle_if(in, out, context, ignore))
-                    return false;
-                break;
-            case Operation::Elif:
-            case Operation::Else:
-            case Operation::Endif:
-                next = op;
-                return true;
-            case Operation::Define:
-                if (!ignore && !handle_define(in, context))
-                    return false;
-                break;
-            case Operation::Undef:
-                if (!ignore && !handle_undef(in, context))
-                    return false;
-                break;
-            default:
-            case Operation::Unknown:
-                if (!ignore) {
-                    out.put(PP_START);
-                    out.write(name, strlen(name));
-                }
-            }
-        } else if (!ignore) {
-            out.put(c);
-        }
-    }
-    return true;
+    static const size_t inlineCapacity = std::string().capacity();
+    return str.capacity() > inlineCapacity ? str.capacity() + 1 : 0; // Short strings are stored inline
 }
 
-bool parse(std::istream& in, std::ostream& out, const Options& options)
+template <typename Container>
+inline size_t hashed_usage(const Container& container)
 {
-    Context context = Context{ options.Tags, 0 };
-    return consume(in, out, context, false);
+    // Every node holds the value, the next pointer and the cached hash
+    return container.bucket_count() * sizeof(void*)
+           + container.size() * (sizeof(typename Container::value_type) + sizeof(void*) + sizeof(size_t));
 }
 
-bool handle_condition(std::istream& in, const Context& ctx);
-bool handle_if(std::istream& in, std::ostream& out, Context& ctx, bool ignore)
-{
-    bool condition = !ignore && handle_condition(in, ctx);
-    bool once_true = false;
-    ctx.Depth += 1;
-
-    Operation current = Operation::If;
-    while (consume_next(in, out, ctx, ignore || once_true || !condition, current)) {
-        if (current == Operation::Endif)
-            break;
+// Tags are interned once per session, such that conditions only have to test bits
+using TagID = uint32_t;
 
-        if (condition /* Previous condition */)
-            once_true = true;
+class TagTable {
+public:
+    TagID intern(const std::string& tag)
+    {
+        const auto it = mIDs.find(tag);
+        if (it != mIDs.end())
+            return it->second;
 
-        if (once_true)
-            condition = false;
-        else if (current == Operation::Elif)
-            condition = handle_condition(in, ctx);
-        else
-            condition = true;
+        const TagID id = static_cast<TagID>(mIDs.size());
+        mIDs.emplace(tag, id);
+        return id;
     }
 
-    ctx.Depth -= 1;
+    bool find(const std::string& tag, TagID& id) const
+    {
+        const auto it = mIDs.find(tag);
+        if (it == mIDs.end())
+            return false;
+        id = it->second;
+        return true;
+    }
+
+    size_t size() const { return mIDs.size(); }
+
+    // Indexed by ID
+    std::vector<std::string> names() const
+    {
+        std::vector<std::string> names(mIDs.size());
+        for (const auto& entry : mIDs)
+            names[entry.second] = entry.first;
+        return names;
+    }
+
+    size_t memoryUsage() const
+    {
+        size_t usage = hashed_usage(mIDs);
+        for (const auto& entry : mIDs)
+            usage += string_usage(entry.first);
+        return usage;
+    }
+
+private:
+    std::unordered_map<std::string, TagID> mIDs;
+};
+
+class TagSet {
+public:
+    TagSet() = default;
+    explicit TagSet(std::vector<uint64_t> bits)
+        : mBits(std::move(bits))
+    {
+    }
+
+    bool test(TagID id) const
+    {
+        const size_t word = id / 64;
+        return word < mBits.size() && ((mBits[word] >> (id % 64)) & 1);
+    }
+
+    void set(TagID id)
+    {
+        const size_t word = id / 64;
+        if (word >= mBits.size())
+            mBits.resize(word + 1, 0);
+        mBits[word] |= uint64_t(1) << (id % 64);
+    }
+
+    void reset(TagID id)
+    {
+        const size_t word = id / 64;
+        if (word < mBits.size())
+            mBits[word] &= ~(uint64_t(1) << (id % 64));
+    }
+
+    size_t memoryUsage() const { return mBits.capacity() * sizeof(uint64_t); }
+
+private:
+    std::vector<uint64_t> mBits;
+};
+
+// Conditions are compiled once into a postfix program and evaluated against the active tags
+enum class OpCode : uint8_t {
+    False,
+    True,
+    Test,
+    Not,
+    And,
+    Or,
+    Xor
+};
+
+struct Instruction {
+    OpCode Code;
+    TagID Tag;
+};
+
+// Evaluates a postfix program. The stack is only scratch space, passed in to be reused between evaluations
+template <typename Ins>
+bool evaluate_program(const Ins* code, size_t size, const TagSet& tags, std::vector<uint8_t>& stack)
+{
+    stack.clear();
+    for (size_t i = 0; i < size; ++i) {
+        const Ins& ins = code[i];
+        switch (static_cast<OpCode>(ins.Code)) {
+        case OpCode::False:
+            stack.push_back(false);
+            break;
+        case OpCode::True:
+            stack.push_back(true);
+            break;
+        case OpCode::Test:
+            stack.push_back(tags.test(ins.Tag));
+            break;
+        case OpCode::Not:
+            stack.back() = !stack.back();
+            break;
+        case OpCode::And:
+        case OpCode::Or:
+        case OpCode::Xor: {
+            const bool b = stack.back();
+            stack.pop_back();
+            const bool a = stack.back();
+            if (static_cast<OpCode>(ins.Code) == OpCode::And)
+                stack.back() = a && b;
+            else if (static_cast<OpCode>(ins.Code) == OpCode::Or)
+                stack.back() = a || b;
+            else
+                stack.back() = a ^ b;
+        } break;
+        }
+    }
+    return !stack.empty() && stack.back();
+}
+
+class CompiledCondition {
+public:
+    void emit(OpCode code, TagID tag = 0) { mCode.push_back(Instruction{ code, tag }); }
+    size_t size() const { return mCode.size(); }
+    void truncate(size_t size) { mCode.resize(size); }
+
+    void emitConstant(bool value) { emit(value ? OpCode::True : OpCode::False); }
+
+    bool isConstant(bool& value) const { return isConstant(0, mCode.size(), value); }
+
+    size_t memoryUsage() const { return mCode.capacity() * sizeof(Instruction) + mStack.capacity(); }
+
+    // Negate the last operand, folding constants and double negations
+    void emitNot()
+    {
+        bool value;
+        if (isConstant(mCode.size() - 1, mCode.size(), value))
+            mCode.back().Code = value ? OpCode::False : OpCode::True;
+        else if (mCode.back().Code == OpCode::Not)
+            mCode.pop_back();
+        else
+            emit(OpCode::Not);
+    }
+
+    // Combine the operands [left, right) and [right, end) with the given operator, folding constant operands
+    void emitBinary(OpCode code, size_t left, size_t right)
+    {
+        bool a, b;
+        const bool constA = isConstant(left, right, a);
+        const bool constB = isConstant(right, mCode.size(), b);
+
+        if (constA && constB) {
+            truncate(left);
+            if (code == OpCode::And)
+                emitConstant(a && b);
+            else if (code == OpCode::Or)
+                emitConstant(a || b);
+            else
+                emitConstant(a ^ b);
+        } else if (constA || constB) {
+            const bool value = constA ? a : b;
+            // Remove the constant operand, the other operand stays in place
+            if (constA)
+                mCode.erase(mCode.begin() + left);
+            else
+                truncate(right);
+
+            if ((code == OpCode::And && !value) || (code == OpCode::Or && value)) {
+                truncate(left);
+                emitConstant(value);
+            } else if (code == OpCode::Xor && value) {
+                emitNot();
+            }
+        } else {
+            emit(code);
+        }
+    }
+
+    bool evaluate(const TagSet& tags) const { return evaluate_program(mCode.data(), mCode.size(), tags, mStack); }
+
+    const std::vector<Instruction>& code() const { return mCode; }
+
+private:
+    bool isConstant(size_t start, size_t end, bool& value) const
+    {
+        if (end != start + 1 || (mCode[start].Code != OpCode::False && mCode[start].Code != OpCode::True))
+            return false;
+        value = mCode[start].Code == OpCode::True;
+        return true;
+    }
+
+    std::vector<Instruction> mCode;
+    mutable std::vector<uint8_t> mStack; // Scratch space, reused between evaluations
+};
+
+// Configurations are evaluated simultaneously, one bit per configuration
+using ConfigMask = uint32_t;
+
+#ifndef STPP_LIBRARY
+// Writes lines differing between two configurations as zero context unified diff hunks.
+// Output of both configurations is buffered up to the next newline included in both, as only there the line numbers are in sync.
+class DiffWriter {
+public:
+    static constexpr ConfigMask FIRST  = 0x1;
+    static constexpr ConfigMask SECOND = 0x2;
+    static constexpr ConfigMask BOTH   = FIRST | SECOND;
+
+    DiffWriter(std::ostream& out, const std::string& label)
+        : mOut(out)
+        , mLabel(label)
+    {
+    }
+
+    void put(char c, ConfigMask mask)
+    {
+        if (mask & FIRST)
+            mCurrent[0] += c;
+        if (mask & SECOND)
+            mCurrent[1] += c;
+        if (c == '\n' && mask == BOTH)
+            sync();
+    }
+
+    void finish()
+    {
+        sync();
+        flush();
+    }
+
+    // Most output held back at once, while the configurations differed or a hunk was open
+    inline size_t peakBuffered() const { return mPeakBuffered; }
+
+private:
+    void sync()
+    {
+        mPeakBuffered = std::max(mPeakBuffered, mCurrent[0].size() + mCurrent[1].size() + mHunk.size());
+        if (mCurrent[0] == mCurrent[1]) {
+            flush();
+            const size_t lines = static_cast<size_t>(std::count(mCurrent[0].begin(), mCurrent[0].end(), '\n'));
+            mLines[0] += lines;
+            mLines[1] += lines;
+        } else {
+            const std::vector<std::string_view> first  = splitLines(mCurrent[0]);
+            const std::vector<std::string_view> second = splitLines(mCurrent[1]);
+
+            // Keep lines shared at the beginning and end out of the hunk
+            size_t prefix = 0;
+            while (prefix < first.size() && prefix < second.size() && first[prefix] == second[prefix])
+                ++prefix;
+            size_t suffix = 0;
+            while (suffix < first.size() - prefix && suffix < second.size() - prefix
+                   && first[first.size() - 1 - suffix] == second[second.size() - 1 - suffix])
+                ++suffix;
+
+            if (prefix > 0) {
+                flush();
+                mLines[0] += prefix;
+                mLines[1] += prefix;
+            }
+
+            if (mHunk.empty()) {
+                mStart[0] = mLines[0];
+                mStart[1] = mLines[1];
+            }
+            appendLines(0, '-', first, prefix, first.size() - suffix);
+            appendLines(1, '+', second, prefix, second.size() - suffix);
+
+            if (suffix > 0) {
+                flush();
+                mLines[0] += suffix;
+                mLines[1] += suffix;
+            }
+        }
+
+        mCurrent[0].clear();
+        mCurrent[1].clear();
+    }
+
+    // Lines keep their newline, such that a missing newline at the end makes the last line differ
+    static std::vector<std::string_view> splitLines(const std::string& text)
+    {
+        std::vector<std::string_view> lines;
+        for (size_t start = 0; start < text.size();) {
+            const size_t end = std::min(text.find('\n', start), text.size() - 1);
+            lines.emplace_back(text.data() + start, end - start + 1);
+            start = end + 1;
+        }
+        return lines;
+    }
+
+    void appendLines(int side, char prefix, const std::vector<std::string_view>& lines, size_t start, size_t end)
+    {
+        for (size_t i = start; i < end; ++i) {
+            mHunk += prefix;
+            mHunk += lines[i];
+            if (lines[i].back() != '\n')
+                mHunk += "\n\\ No newline at end of file\n";
+            ++mCounts[side];
+            ++mLines[side];
+        }
+    }
+
+    void flush()
+    {
+        if (mHunk.empty())
+            return;
+        mPeakBuffered = std::max(mPeakBuffered, mHunk.size());
+
+        if (!mHeaderWritten) {
+            mOut << "--- " << mLabel << "\n"
+                 << "+++ " << mLabel << "\n";
+            mHeaderWritten = true;
+        }
+
+        // An empty side refers to the line before the hunk
+        const auto range = [this](int i) { return std::to_string(mCounts[i] > 0 ? mStart[i] + 1 : mStart[i]) + "," + std::to_string(mCounts[i]); };
+        mOut << "@@ -" << range(0) << " +" << range(1) << " @@\n"
+             << mHunk;
+
+        mHunk.clear();
+        mCounts[0] = mCounts[1] = 0;
+    }
+
+    std::ostream& mOut;
+    const std::string mLabel;
+    std::string mCurrent[2]; // Output per configuration since the last common newline
+    std::string mHunk;
+    size_t mLines[2]     = { 0, 0 }; // Completed lines per configuration
+    size_t mStart[2]     = { 0, 0 }; // Lines per configuration before the current hunk
+    size_t mCounts[2]    = { 0, 0 }; // Lines per configuration in the current hunk
+    size_t mPeakBuffered = 0;
+    bool mHeaderWritten  = false;
+};
+#endif
+
+// Results are memoized per configuration until the tag state changes
+struct CachedCondition {
+    CompiledCondition Program;
+    uint64_t Epoch    = UINT64_MAX; // Epoch of the memoized results
+    ConfigMask Known  = 0;          // Configurations with a memoized result
+    ConfigMask Values = 0;
+};
+
+struct Context {
+    TagTable Table;
+    std::vector<TagSet> Tags; // Active tags per configuration
+    ConfigMask AllConfigs = 0x1;
+    std::unordered_map<std::string, CachedCondition> Conditions; // Keyed by the expression text
+    uint64_t Epoch = 0;                                           // Bumped whenever a #define or #undef changes a tag
+    TagSet Mutable;                                                 // Tags modified somewhere in the current input
+    bool FoldTags = false;                                          // Fold all tags not in the mutable set
+    const DirectiveTable* Directives = &builtin_directives();
+    const std::vector<stpp::DirectiveHandler>* Handlers = nullptr; // Custom directives in order of registration
+    std::vector<stpp::Annotation>* Annotations          = nullptr; // Only collected if set
+    const stpp::TagProviders* Providers                 = nullptr; // Computes tags on first reference
+    TagSet Resolved;                                               // Tags with a known initial value, only tracked with providers
+
+    // Limits
+    Budget Limits;
+    std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+    size_t OutputSize                           = 0;
+
+    // Statistics
+    size_t MappedInput           = 0; // Size of the mapped input file, zero if it is read
+    size_t OutputBuffered        = 0; // Peak output held back before writing it
+    size_t DirectiveIndexUsage   = 0;
+    size_t ConditionsCompiled    = 0;
+    size_t ConditionsConstant    = 0;
+    size_t ConditionsEvaluated   = 0;
+    size_t ConditionsMemoized    = 0;
+};
+
+bool scan_directives(std::istream& in, std::unordered_set<std::string>& mutableTags, std::unordered_set<std::string>* conditionTags);
+void scan_directives(std::string_view input, std::unordered_set<std::string>& mutableTags, std::unordered_set<std::string>* conditionTags);
+
+// Sources
+// Directives are read character by character, plain text as spans up to the next directive start.
+// Before preprocessing, sources may scan the whole input for the directive index.
+class StreamSource {
+public:
+    explicit StreamSource(std::istream& in)
+        : mIn(in)
+    {
+    }
+
+    inline bool get(char& c) { return static_cast<bool>(mIn.get(c)); }
+
+    // Only seekable streams can be scanned
+    bool scan(std::unordered_set<std::string>& mutableTags, std::unordered_set<std::string>* conditionTags)
+    {
+        return scan_directives(mIn, mutableTags, conditionTags);
+    }
+
+    // Returns false at the end of the input. The directive start is consumed but not part of the span.
+    // The span is only valid until the next call
+    bool text(const char*& data, size_t& size, bool& directive)
+    {
+        mIn.get(mBuffer, sizeof(mBuffer), PP_START);
+        size = static_cast<size_t>(mIn.gcount());
+        if (size == 0 && !mIn.eof())
+            mIn.clear(); // Nothing extracted as the directive start came first
+
+        directive = mIn.peek() == PP_START;
+        if (directive)
+            mIn.ignore();
+
+        data = mBuffer;
+        return size > 0 || directive;
+    }
+
+    // Offset in the input, zero if the stream can not tell
+    uint64_t consumed() const
+    {
+        const std::streamoff pos = mIn.tellg();
+        return pos > 0 ? static_cast<uint64_t>(pos) : 0;
+    }
+
+private:
+    std::istream& mIn;
+    char mBuffer[4096];
+};
+
+// Text spans point directly into the input
+class MemorySource {
+public:
+    explicit MemorySource(std::string_view input)
+        : mBegin(input.data())
+        , mPos(input.data())
+        , mEnd(input.data() + input.size())
+    {
+    }
+
+    inline bool get(char& c)
+    {
+        if (mPos == mEnd)
+            return false;
+        c = *mPos++;
+        return true;
+    }
+
+    bool scan(std::unordered_set<std::string>& mutableTags, std::unordered_set<std::string>* conditionTags)
+    {
+        scan_directives(std::string_view(mPos, mEnd - mPos), mutableTags, conditionTags);
+        return true;
+    }
+
+    bool text(const char*& data, size_t& size, bool& directive)
+    {
+        if (mPos == mEnd)
+            return false;
+
+        const char* start = static_cast<const char*>(std::memchr(mPos, PP_START, mEnd - mPos));
+        directive         = start != nullptr;
+        data              = mPos;
+        size              = (directive ? start : mEnd) - mPos;
+        mPos              = directive ? start + 1 : mEnd;
+        return true;
+    }
+
+    inline uint64_t consumed() const { return static_cast<uint64_t>(mPos - mBegin); }
+
+private:
+    const char* mBegin;
+    const char* mPos;
+    const char* mEnd;
+};
+
+template <typename Source>
+bool handle_condition(Source& in, Context& ctx, ConfigMask configs, ConfigMask& value);
+template <typename Source>
+bool handle_define(Source& in, Context& ctx, ConfigMask active);
+template <typename Source>
+bool handle_undef(Source& in, Context& ctx, ConfigMask active);
+template <typename Source>
+std::string get_line(Source& in);
+
+// The output limit is enforced for every span written, the time limit for every directive and text span read
+bool check_output(const Context& ctx, size_t size)
+{
+    const Budget& limits = ctx.Limits;
+    if (limits.Output > 0 && ctx.OutputSize + size > limits.Output) {
+        std::cerr << "Output exceeds the limit of " << limits.Output << " bytes. Aborting." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool check_limits(const Context& ctx)
+{
+    const Budget& limits = ctx.Limits;
+    if (limits.Time > 0) {
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - ctx.Start;
+        if (elapsed.count() > limits.Time) {
+            std::cerr << "Preprocessing exceeds the limit of " << limits.Time << " seconds. Aborting." << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Output for the given configurations
+struct OutputSpan {
+    const char* Data  = nullptr;
+    size_t Size       = 0;
+    ConfigMask Active = 0;
+};
+
+// The engine is resumable: Every call to next() advances the input until the next output span is available.
+// Open blocks are kept on an explicit stack instead of the call stack, so the state survives between calls.
+template <typename Source>
+class Engine {
+public:
+    Engine(Source& source, Context& context)
+        : mSource(source)
+        , mContext(context)
+    {
+    }
+
+    // Returns false at the end of the input or on errors. The span is only valid until the next call
+    bool next(OutputSpan& span)
+    {
+        while (!mFailed) {
+            if (mDirective) {
+                mDirective = false;
+                if (directive(span))
+                    return true;
+                continue;
+            }
+
+            if (!mSource.text(span.Data, span.Size, mDirective)) {
+                if (!mBlocks.empty()) {
+                    std::cerr << "Missing #endif at end of input" << std::endl;
+                    mFailed = true;
+                }
+                closeAnnotations(mContext.OutputSize);
+                break;
+            }
+            if (!check_limits(mContext))
+                return fail();
+
+            span.Active = active();
+            if (span.Size > 0 && span.Active)
+                return emit(span);
+        }
+        return false;
+    }
+
+    inline bool failed() const { return mFailed; }
+
+private:
+    struct Block {
+        ConfigMask Active;    // Configurations active around the block
+        ConfigMask Condition; // Configurations the current branch holds for
+        ConfigMask OnceTrue;  // Configurations any previous branch held for
+    };
+
+    inline ConfigMask active() const
+    {
+        if (mBlocks.empty())
+            return mContext.AllConfigs;
+
+        const Block& block = mBlocks.back();
+        return block.Active & ~block.OnceTrue & block.Condition;
+    }
+
+    inline bool fail()
+    {
+        mFailed = true;
+        return false;
+    }
+
+    // Accounts the span as written and measures the lines of annotations. Fails if the span exceeds the output limit
+    inline bool emit(const OutputSpan& span)
+    {
+        if (!check_output(mContext, span.Size))
+            return fail();
+
+        if (mContext.Annotations && mOpenAnnotation < mContext.Annotations->size()) {
+            const char* end = static_cast<const char*>(std::memchr(span.Data, '\n', span.Size));
+            if (end)
+                closeAnnotations(mContext.OutputSize + (end - span.Data));
+        }
+        mContext.OutputSize += span.Size;
+        return true;
+    }
+
+    void closeAnnotations(size_t lineEnd)
+    {
+        if (!mContext.Annotations)
+            return;
+
+        std::vector<stpp::Annotation>& annotations = *mContext.Annotations;
+        for (; mOpenAnnotation < annotations.size(); ++mOpenAnnotation)
+            annotations[mOpenAnnotation].Length = lineEnd - annotations[mOpenAnnotation].Offset;
+    }
+
+    // Handles the directive following a directive start. Returns true if it produced output
+    bool directive(OutputSpan& span)
+    {
+        if (!check_limits(mContext))
+            return fail();
+
+        const char* name;
+        size_t custom           = 0;
+        bool lineEnd            = false;
+        const Operation op      = extract_operation(mSource, *mContext.Directives, name, custom, lineEnd);
+        const ConfigMask active = this->active();
+        switch (op) {
+        case Operation::If: {
+            ConfigMask condition = 0;
+            if (active && !handle_condition(mSource, mContext, active, condition))
+                return fail();
+            mBlocks.push_back(Block{ active, condition, 0 });
+
+            const size_t maxDepth = mContext.Limits.Depth;
+            if (maxDepth > 0 && mBlocks.size() > maxDepth) {
+                std::cerr << "Blocks are nested deeper than the limit of " << maxDepth << ". Aborting." << std::endl;
+                return fail();
+            }
+            return false;
+        }
+        case Operation::Elif:
+        case Operation::Else:
+        case Operation::Endif:
+            if (!mBlocks.empty())
+                return branch(op);
+            break; // Outside of any block these are passed through like unknown directives
+        case Operation::Define:
+            if (active && !handle_define(mSource, mContext, active))
+                return fail();
+            return false;
+        case Operation::Undef:
+            if (active && !handle_undef(mSource, mContext, active))
+                return fail();
+            return false;
+        case Operation::Custom:
+            return active && handle_custom(span, custom, active, lineEnd);
+        default:
+        case Operation::Unknown:
+            break;
+        }
+
+        if (!active)
+            return false;
+
+        // FIXME: We lose the whitespaces....
+        const size_t length = strlen(name);
+        if (mContext.Annotations && name[0] == '[')
+            return annotation(span, name, length, active);
+
+        mEcho[0] = PP_START;
+        std::memcpy(mEcho + 1, name, length);
+        span = OutputSpan{ mEcho, length + 1, active };
+        return emit(span);
+    }
+
+    // Annotation names may be longer than any directive, the rest of a name cut off by extract_operation() is read here
+    bool annotation(OutputSpan& span, const char* name, size_t length, ConfigMask active)
+    {
+        mCustom.assign(1, PP_START).append(name, length);
+        bool closed = std::memchr(name, ']', length) != nullptr;
+        char c;
+        while (!closed && length == MAX_OPERATION_SIZE && mSource.get(c)) {
+            if (std::isspace(static_cast<unsigned char>(c)))
+                break;
+            mCustom += c;
+            closed = c == ']';
+        }
+
+        const size_t close = mCustom.find(']');
+        if (close == std::string::npos)
+            std::cerr << "Annotation '" << mCustom << "' is not closed, ignoring it" << std::endl;
+        else if (close > 2)
+            mContext.Annotations->push_back(stpp::Annotation{ mCustom.substr(2, close - 2), mContext.OutputSize, 0 });
+
+        span = OutputSpan{ mCustom.data(), mCustom.size(), active };
+        return emit(span);
+    }
+
+    // The handler replaces the directive and the rest of its line
+    bool handle_custom(OutputSpan& span, size_t custom, ConfigMask active, bool lineEnd)
+    {
+        const std::string arguments = lineEnd ? std::string() : get_line(mSource);
+        mCustom.clear();
+        if (!(*mContext.Handlers)[custom](arguments, mCustom))
+            return fail();
+
+        span = OutputSpan{ mCustom.data(), mCustom.size(), active };
+        return emit(span) && span.Size > 0;
+    }
+
+    bool branch(Operation op)
+    {
+        if (op == Operation::Endif) {
+            mBlocks.pop_back();
+            return false;
+        }
+
+        Block& block = mBlocks.back();
+        block.OnceTrue |= block.Condition; // Previous condition
+
+        const ConfigMask remaining = mContext.AllConfigs & ~block.OnceTrue;
+        if (op == Operation::Elif) {
+            block.Condition = 0;
+            if (remaining && !handle_condition(mSource, mContext, remaining, block.Condition))
+                return fail();
+        } else {
+            block.Condition = remaining;
+        }
+        return false;
+    }
+
+    Source& mSource;
+    Context& mContext;
+    std::vector<Block> mBlocks;
+    bool mDirective        = false; // A directive start was consumed but not handled yet
+    bool mFailed           = false;
+    size_t mOpenAnnotation = 0; // First annotation with an unknown line length
+    char mEcho[MAX_OPERATION_SIZE + 1];
+    std::string mCustom; // Output of the last custom directive
+};
+
+// Directive index
+// Collects all tags touched by a #define or #undef anywhere in the input, regardless of the enclosing blocks.
+// Optionally collects all tags referenced by any condition as well.
+// The scan is line based and only applicable to seekable inputs, as the stream is rewound afterwards.
+// A directive keyword ending its line takes its argument from the next line, the same as get_tag() and get_line() do.
+enum class ScanPending {
+    None,
+    Tag,      // First word of the next line
+    Condition // Next line
+};
+
+#ifndef STPP_LIBRARY
+void collect_condition_tags(std::string_view expr, std::unordered_set<std::string>& tags);
+#endif
+
+// Condition tags are only collected for the reverse index of the command line, the library never asks for them
+inline void collect_scanned_condition(std::string_view expr, std::unordered_set<std::string>* conditionTags)
+{
+#ifndef STPP_LIBRARY
+    if (conditionTags)
+        collect_condition_tags(expr, *conditionTags);
+#else
+    (void)expr;
+    (void)conditionTags;
+#endif
+}
+
+ScanPending scan_directive_line(std::string_view line, ScanPending pending, std::unordered_set<std::string>& mutableTags,
+                                std::unordered_set<std::string>* conditionTags)
+{
+    const auto skip_space = [&](size_t pos) {
+        while (pos < line.size() && std::isspace(line[pos]))
+            ++pos;
+        return pos;
+    };
+    const auto skip_word = [&](size_t pos, size_t max) {
+        const size_t end = pos + std::min(line.size() - pos, max);
+        while (pos < end && !std::isspace(line[pos]))
+            ++pos;
+        return pos;
+    };
+
+    // The rest of the line is scanned as well, which at most finds more tags than necessary
+    if (pending == ScanPending::Tag) {
+        const size_t tagStart = skip_space(0);
+        const size_t tagEnd   = skip_word(tagStart, line.size());
+        if (tagEnd > tagStart)
+            mutableTags.emplace(line.substr(tagStart, tagEnd - tagStart));
+    } else if (pending == ScanPending::Condition) {
+        collect_scanned_condition(line, conditionTags);
+    }
+
+    pending    = ScanPending::None;
+    size_t pos = line.find(PP_START);
+    while (pos != std::string_view::npos) {
+        const size_t opStart = skip_space(pos + 1);
+        const size_t opEnd   = skip_word(opStart, MAX_OPERATION_SIZE);
+        const Operation op   = to_operation(line.substr(opStart, opEnd - opStart));
+        const bool lineEnd   = opEnd == line.size() && opEnd > opStart;
+
+        pos = opEnd;
+        if ((op == Operation::Define || op == Operation::Undef) && lineEnd) {
+            pending = ScanPending::Tag;
+        } else if ((op == Operation::If || op == Operation::Elif) && lineEnd) {
+            pending = ScanPending::Condition;
+        } else if (op == Operation::Define || op == Operation::Undef) {
+            const size_t tagStart = skip_space(opEnd);
+            const size_t tagEnd   = skip_word(tagStart, line.size());
+            if (tagEnd > tagStart)
+                mutableTags.emplace(line.substr(tagStart, tagEnd - tagStart));
+            pos = tagEnd;
+        } else if (op == Operation::If || op == Operation::Elif) {
+            collect_scanned_condition(line.substr(opEnd), conditionTags);
+        }
+        pos = line.find(PP_START, pos);
+    }
+    return pending;
+}
+
+bool scan_directives(std::istream& in, std::unordered_set<std::string>& mutableTags, std::unordered_set<std::string>* conditionTags)
+{
+    const auto start = in.tellg();
+    if (start == std::istream::pos_type(-1))
+        return false;
+
+    std::string line;
+    ScanPending pending = ScanPending::None;
+    while (std::getline(in, line))
+        pending = scan_directive_line(line, pending, mutableTags, conditionTags);
+
+    in.clear();
+    in.seekg(start);
+    return in.good();
+}
+
+void scan_directives(std::string_view input, std::unordered_set<std::string>& mutableTags, std::unordered_set<std::string>* conditionTags)
+{
+    ScanPending pending = ScanPending::None;
+    while (!input.empty()) {
+        const size_t end = std::min(input.find('\n'), input.size());
+        pending          = scan_directive_line(input.substr(0, end), pending, mutableTags, conditionTags);
+        input.remove_prefix(std::min(end + 1, input.size()));
+    }
+}
+
+// Enables folding of all tags not touched by the input
+void fold_tags(Context& context, const std::unordered_set<std::string>& mutableTags)
+{
+    context.FoldTags = true;
+    for (const auto& tag : mutableTags)
+        context.Mutable.set(context.Table.intern(tag));
+
+    context.DirectiveIndexUsage = hashed_usage(mutableTags) + context.Mutable.memoryUsage();
+    for (const auto& tag : mutableTags)
+        context.DirectiveIndexUsage += string_usage(tag);
+}
+
+#ifndef STPP_LIBRARY
+// Returns the peak resident set size of the process in bytes or zero if unknown
+size_t peak_rss()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+void print_statistics(const Context& context)
+{
+    size_t cacheUsage = hashed_usage(context.Conditions);
+    for (const auto& entry : context.Conditions)
+        cacheUsage += string_usage(entry.first) + entry.second.Program.memoryUsage();
+
+    const auto line = [](const char* name, size_t value) {
+        std::cerr << "    " << std::left << std::setw(24) << name << value << "\n";
+    };
+
+    std::cerr << "Statistics:\n";
+    line("Peak RSS [B]", peak_rss());
+    line("Mapped input [B]", context.MappedInput);
+    line("Output buffered [B]", context.OutputBuffered);
+    line("Directive index [B]", context.DirectiveIndexUsage);
+    size_t tagUsage = context.Table.memoryUsage();
+    for (const auto& tags : context.Tags)
+        tagUsage += tags.memoryUsage();
+
+    line("Tag table [B]", tagUsage);
+    line("Condition cache [B]", cacheUsage);
+    line("Tags", context.Table.size());
+    line("Conditions compiled", context.ConditionsCompiled);
+    line("Conditions constant", context.ConditionsConstant);
+    line("Conditions evaluated", context.ConditionsEvaluated);
+    line("Conditions memoized", context.ConditionsMemoized);
+    std::cerr << std::flush;
+}
+
+// Sinks
+// Receive every output span, which is only valid during the call.
+// Sinks are selected once per file, such that the output loop is inlined for each.
+class StreamSink {
+public:
+    explicit StreamSink(std::ostream& out)
+        : mOut(out)
+    {
+    }
+
+    inline void write(const OutputSpan& span) { mOut.write(span.Data, span.Size); }
+
+private:
+    std::ostream& mOut;
+};
+
+class DiffSink {
+public:
+    explicit DiffSink(DiffWriter& writer)
+        : mWriter(writer)
+    {
+    }
+
+    inline void write(const OutputSpan& span)
+    {
+        for (size_t i = 0; i < span.Size; ++i)
+            mWriter.put(span.Data[i], span.Active);
+    }
+
+private:
+    DiffWriter& mWriter;
+};
+
+// Drops the input and output from the page cache behind the engine. Checked every few spans or kilobytes of output,
+// as excluded blocks produce no spans while the input keeps advancing. Long spans are written in chunks, and spans
+// pointing into a mapped input only release it up to the part written so far
+constexpr size_t DROP_CACHE_CHECK_SPANS = 1024;
+constexpr size_t DROP_CACHE_CHECK_BYTES = 64 * 1024;
+
+template <typename Source, typename Sink>
+class DroppingSink {
+public:
+    DroppingSink(Sink& sink, const Source& source, std::ostream& out, const Options& options, std::string_view mapping)
+        : mSink(sink)
+        , mSource(source)
+        , mOut(out)
+        , mMapping(mapping)
+        , mInput(options.Input, false, mapping.empty() ? nullptr : mapping.data())
+        , mOutput(options.Output, true)
+    {
+    }
+
+    inline void write(const OutputSpan& span)
+    {
+        OutputSpan chunk = span;
+        while (chunk.Size > DROP_CACHE_CHUNK) {
+            OutputSpan head = chunk;
+            head.Size       = DROP_CACHE_CHUNK;
+            chunk.Data += DROP_CACHE_CHUNK;
+            chunk.Size -= DROP_CACHE_CHUNK;
+            mSink.write(head);
+            drop(chunk.Data);
+        }
+
+        mSink.write(chunk);
+        mBytes += chunk.Size;
+        if (++mSpans < DROP_CACHE_CHECK_SPANS && mBytes < DROP_CACHE_CHECK_BYTES)
+            return;
+        drop(chunk.Data + chunk.Size);
+    }
+
+private:
+    // Last is the end of the data written last
+    void drop(const char* last)
+    {
+        mSpans = mBytes = 0;
+        const bool inMapping = !mMapping.empty() && last > mMapping.data() && last <= mMapping.data() + mMapping.size();
+        mInput.advance(inMapping ? static_cast<uint64_t>(last - mMapping.data()) : mSource.consumed());
+        mOut.flush();
+        const std::streamoff written = mOut.tellp();
+        if (written > 0)
+            mOutput.advance(static_cast<uint64_t>(written));
+    }
+
+    Sink& mSink;
+    const Source& mSource;
+    std::ostream& mOut;
+    std::string_view mMapping;
+    CacheDropper mInput;
+    CacheDropper mOutput;
+    size_t mSpans = 0;
+    size_t mBytes = 0;
+};
+
+template <typename Source, typename Sink>
+bool run_engine(Source& source, Sink& sink, Context& context)
+{
+    Engine<Source> engine(source, context);
+    OutputSpan span;
+    while (engine.next(span))
+        sink.write(span);
+    return !engine.failed();
+}
+
+// Referenced tags are all tags used in the input, including excluded blocks. They are only available for seekable inputs
+// Mapping is the mapped input file if there is one, for the statistics and DropCache
+template <typename Source>
+bool parse_source(Source& source, std::ostream& out, const Options& options, std::unordered_set<std::string>* referencedTags, std::vector<stpp::Annotation>* annotations,
+                  std::string_view mapping = {})
+{
+    Context context;
+    context.Limits      = options.Limits;
+    context.Annotations = annotations;
+    context.MappedInput = mapping.size();
+
+    const bool diff = options.Mode == RunMode::Diff;
+    context.Tags.resize(diff ? 2 : 1);
+    context.AllConfigs = diff ? DiffWriter::BOTH : 0x1;
+    for (const auto& tag : options.Tags)
+        context.Tags[0].set(context.Table.intern(tag));
+    if (diff) {
+        for (const auto& tag : options.AgainstTags)
+            context.Tags[1].set(context.Table.intern(tag));
+    }
+
+    std::unordered_set<std::string> mutableTags;
+    if (source.scan(mutableTags, referencedTags)) {
+        // Tags differing between configurations can not be folded either
+        if (diff) {
+            for (const auto& tag : options.Tags) {
+                if (!options.AgainstTags.count(tag))
+                    context.Mutable.set(context.Table.intern(tag));
+            }
+            for (const auto& tag : options.AgainstTags) {
+                if (!options.Tags.count(tag))
+                    context.Mutable.set(context.Table.intern(tag));
+            }
+        }
+        fold_tags(context, mutableTags);
+    } else if (referencedTags) {
+        std::cerr << "Can not index tags of a non-seekable input" << std::endl;
+    }
+
+    bool result;
+    if (diff) {
+        DiffWriter writer(out, options.Input.empty() ? "--" : options.Input);
+        DiffSink sink(writer);
+        if (options.DropCache) {
+            DroppingSink<Source, DiffSink> dropping(sink, source, out, options, mapping);
+            result = run_engine(source, dropping, context);
+        } else {
+            result = run_engine(source, sink, context);
+        }
+        writer.finish();
+        context.OutputBuffered = writer.peakBuffered();
+    } else {
+        StreamSink sink(out);
+        if (options.DropCache) {
+            DroppingSink<Source, StreamSink> dropping(sink, source, out, options, mapping);
+            result = run_engine(source, dropping, context);
+        } else {
+            result = run_engine(source, sink, context);
+        }
+    }
+
+    if (options.Stats)
+        print_statistics(context);
+    return result;
+}
+
+bool parse(std::istream& in, std::ostream& out, const Options& options, std::unordered_set<std::string>* referencedTags, std::vector<stpp::Annotation>* annotations)
+{
+    StreamSource source(in);
+    return parse_source(source, out, options, referencedTags, annotations);
+}
+
+bool parse(std::string_view input, std::ostream& out, const Options& options, std::unordered_set<std::string>* referencedTags, std::vector<stpp::Annotation>* annotations, bool mapped)
+{
+    MemorySource source(input);
+    return parse_source(source, out, options, referencedTags, annotations, mapped ? input : std::string_view());
+}
+#endif
+
+template <typename Source>
+std::string get_tag(Source& in)
+{
+    std::string buffer;
+    bool started = false;
+    char c;
+    while (in.get(c)) {
+        if (c == '\n')
+            break;
+        if (!std::isspace(c)) {
+            buffer += c;
+            started = true;
+        } else if (started) {
+            break;
+        }
+    }
+    return buffer;
+}
+
+template <typename Source>
+bool handle_define(Source& in, Context& ctx, ConfigMask active)
+{
+    const std::string tag = get_tag(in);
+    if (tag.empty()) {
+        std::cerr << "Define statement without tag" << std::endl;
+        return false;
+    } else {
+        const TagID id = ctx.Table.intern(tag);
+        if (ctx.Providers)
+            ctx.Resolved.set(id); // Overwritten anyway
+        for (size_t i = 0; i < ctx.Tags.size(); ++i) {
+            if ((active & (1 << i)) && !ctx.Tags[i].test(id)) {
+                ctx.Tags[i].set(id);
+                ++ctx.Epoch;
+            }
+        }
+        return true;
+    }
+}
+
+template <typename Source>
+bool handle_undef(Source& in, Context& ctx, ConfigMask active)
+{
+    const std::string tag = get_tag(in);
+    if (tag.empty()) {
+        std::cerr << "Undef statement without tag" << std::endl;
+        return false;
+    } else {
+        if (ctx.Providers)
+            ctx.Resolved.set(ctx.Table.intern(tag)); // Overwritten anyway
+
+        TagID id;
+        if (ctx.Table.find(tag, id)) {
+            for (size_t i = 0; i < ctx.Tags.size(); ++i) {
+                if ((active & (1 << i)) && ctx.Tags[i].test(id)) {
+                    ctx.Tags[i].reset(id);
+                    ++ctx.Epoch;
+                }
+            }
+        }
+        return true;
+    }
+}
+
+// Expressions
+enum class TokenType {
+    Tag,
+    ParantheseOpen,
+    ParantheseClose,
+    And,
+    Or,
+    Xor,
+    Not,
+    EOS
+};
+
+struct Token {
+    TokenType Type;
+    std::string_view Tag; // Points into the lexed expression
+};
+
+// Characters are classified by a single table lookup instead of a chain of comparisons
+enum class CharClass : uint8_t {
+    Tag,
+    Space,
+    Not,
+    Xor,
+    ParantheseOpen,
+    ParantheseClose,
+    And,
+    Or
+};
+
+struct CharClassTable {
+    CharClass Classes[256];
+
+    constexpr CharClassTable()
+        : Classes()
+    {
+        for (size_t i = 0; i < 256; ++i)
+            Classes[i] = CharClass::Tag;
+        for (const char c : { ' ', '\t', '\n', '\v', '\f', '\r' })
+            Classes[static_cast<unsigned char>(c)] = CharClass::Space;
+        Classes[static_cast<unsigned char>('!')] = CharClass::Not;
+        Classes[static_cast<unsigned char>('^')] = CharClass::Xor;
+        Classes[static_cast<unsigned char>('(')] = CharClass::ParantheseOpen;
+        Classes[static_cast<unsigned char>(')')] = CharClass::ParantheseClose;
+        Classes[static_cast<unsigned char>('&')] = CharClass::And;
+        Classes[static_cast<unsigned char>('|')] = CharClass::Or;
+    }
+
+    inline CharClass operator()(char c) const { return Classes[static_cast<unsigned char>(c)]; }
+};
+constexpr CharClassTable CHAR_CLASS;
+
+class ExprLexer {
+public:
+    // The expression has to outlive the lexer, as tag tokens refer to it
+    ExprLexer(std::string_view expr, bool diagnostics = true)
+        : mPosition(0)
+    {
+        const size_t size = expr.size();
+        for (size_t i = 0; i < size;) {
+            const CharClass cls = CHAR_CLASS(expr[i]);
+            switch (cls) {
+            case CharClass::Tag: {
+                const size_t start = i;
+                while (i < size && CHAR_CLASS(expr[i]) == CharClass::Tag)
+                    ++i;
+                mTokens.push_back(Token{ TokenType::Tag, expr.substr(start, i - start) });
+            } break;
+            case CharClass::Space:
+                ++i;
+                break;
+            case CharClass::And:
+            case CharClass::Or: {
+                const bool isAnd = cls == CharClass::And;
+                if (i + 1 < size && CHAR_CLASS(expr[i + 1]) == cls)
+                    ++i;
+                else if (diagnostics)
+                    std::cerr << (isAnd ? "And operator is && not &" : "Or operator is || not |") << std::endl;
+                mTokens.push_back(Token{ isAnd ? TokenType::And : TokenType::Or, {} });
+                ++i;
+            } break;
+            default:
+                mTokens.push_back(Token{ SINGLE_TOKENS[static_cast<size_t>(cls)], {} });
+                ++i;
+                break;
+            }
+        }
+    }
+
+    bool accept(TokenType type)
+    {
+        const bool good = current().Type == type;
+        if (!good)
+            std::cerr << "Expected '" << tokenStr(type) << "' but got '" << tokenStr(current().Type) << "'" << std::endl;
+        ++mPosition;
+        return good;
+    }
+
+    void accept()
+    {
+        ++mPosition;
+    }
+
+    Token current()
+    {
+        if (mPosition >= mTokens.size())
+            return Token{ TokenType::EOS, {} };
+        else
+            return mTokens[mPosition];
+    }
+
+private:
+    // Token types of the single character classes, indexed by CharClass
+    static constexpr TokenType SINGLE_TOKENS[] = { TokenType::Tag, TokenType::EOS, TokenType::Not, TokenType::Xor,
+                                                   TokenType::ParantheseOpen, TokenType::ParantheseClose };
+
+    static inline const char* tokenStr(TokenType type)
+    {
+        switch (type) {
+        case TokenType::Tag:
+            return "Tag";
+        case TokenType::ParantheseOpen:
+            return "(";
+        case TokenType::ParantheseClose:
+            return ")";
+        case TokenType::And:
+            return "&&";
+        case TokenType::Or:
+            return "||";
+        case TokenType::Xor:
+            return "^";
+        case TokenType::Not:
+            return "!";
+        default:
+        case TokenType::EOS:
+            return "EOS";
+        }
+    }
+
+    std::vector<Token> mTokens;
+    size_t mPosition;
+};
+
+#ifndef STPP_LIBRARY
+void collect_condition_tags(std::string_view expr, std::unordered_set<std::string>& tags)
+{
+    for (ExprLexer lexer(expr, false); lexer.current().Type != TokenType::EOS; lexer.accept()) {
+        if (lexer.current().Type == TokenType::Tag)
+            tags.emplace(lexer.current().Tag);
+    }
+}
+#endif
+
+// Sets the initial value of a tag computed by its provider, if any
+void resolve_tag(Context& ctx, TagID id, const std::string& tag)
+{
+    ctx.Resolved.set(id);
+
+    bool value;
+    if (!ctx.Providers->resolve(tag, value) || !value)
+        return;
+    for (TagSet& tags : ctx.Tags)
+        tags.set(id);
+    ++ctx.Epoch;
+}
+
+// The compiler walks the exact same grammar as an immediate evaluation would.
+// Parsing does not depend on tag values, therefore malformed sub-expressions are replaced by constant false.
+void binary_condition(ExprLexer& lexer, Context& ctx, CompiledCondition& cond);
+void primary_condition(ExprLexer& lexer, Context& ctx, CompiledCondition& cond)
+{
+    if (lexer.current().Type == TokenType::ParantheseOpen) {
+        lexer.accept();
+        const size_t start = cond.size();
+        binary_condition(lexer, ctx, cond);
+        if (!lexer.accept(TokenType::ParantheseClose)) {
+            cond.truncate(start);
+            cond.emitConstant(false);
+        }
+    } else {
+        Token tag = lexer.current();
+        if (!lexer.accept(TokenType::Tag)) {
+            cond.emitConstant(false);
+            return;
+        }
+
+        const std::string name = std::string(tag.Tag);
+        const TagID id         = ctx.Table.intern(name);
+        if (ctx.Providers && !ctx.Resolved.test(id))
+            resolve_tag(ctx, id, name);
+        if (ctx.FoldTags && !ctx.Mutable.test(id))
+            cond.emitConstant(ctx.Tags[0].test(id)); // Same for all configurations
+        else
+            cond.emit(OpCode::Test, id);
+    }
+}
+
+void unary_condition(ExprLexer& lexer, Context& ctx, CompiledCondition& cond)
+{
+    if (lexer.current().Type == TokenType::Not) {
+        lexer.accept();
+        unary_condition(lexer, ctx, cond);
+        cond.emitNot();
+    } else {
+        primary_condition(lexer, ctx, cond);
+    }
+}
+
+void binary_condition(ExprLexer& lexer, Context& ctx, CompiledCondition& cond)
+{
+    const size_t start = cond.size();
+    unary_condition(lexer, ctx, cond);
+    const size_t mid = cond.size();
+
+    if (lexer.current().Type == TokenType::EOS || lexer.current().Type == TokenType::ParantheseClose) {
+        lexer.accept();
+    } else if (lexer.current().Type == TokenType::And) {
+        lexer.accept();
+        binary_condition(lexer, ctx, cond);
+        cond.emitBinary(OpCode::And, start, mid);
+    } else if (lexer.current().Type == TokenType::Or) {
+        lexer.accept();
+        binary_condition(lexer, ctx, cond);
+        cond.emitBinary(OpCode::Or, start, mid);
+    } else if (lexer.current().Type == TokenType::Xor) {
+        lexer.accept();
+        binary_condition(lexer, ctx, cond);
+        cond.emitBinary(OpCode::Xor, start, mid);
+    } else {
+        cond.truncate(start); // TODO
+        cond.emitConstant(false);
+    }
+}
+
+template <typename Source>
+std::string get_line(Source& in)
+{
+    std::string line;
+    char c;
+    while (in.get(c) && c != '\n')
+        line += c;
+    return line;
+}
+
+// Stops reading and returns false as soon as the line exceeds the given size, unless it is zero
+template <typename Source>
+bool get_line(Source& in, std::string& line, size_t maxSize)
+{
+    char c;
+    while (in.get(c) && c != '\n') {
+        if (maxSize > 0 && line.size() == maxSize)
+            return false;
+        line += c;
+    }
+    return true;
+}
+
+// Evaluates the condition for the given configurations only
+template <typename Source>
+bool handle_condition(Source& in, Context& ctx, ConfigMask configs, ConfigMask& value)
+{
+    std::string expr;
+    if (!get_line(in, expr, ctx.Limits.Expression)) {
+        std::cerr << "Condition exceeds the limit of " << ctx.Limits.Expression << " bytes. Aborting." << std::endl;
+        return false;
+    }
+
+    auto it = ctx.Conditions.find(expr);
+    if (it == ctx.Conditions.end()) {
+        CompiledCondition cond;
+        ExprLexer lexer(expr);
+        if (lexer.current().Type == TokenType::EOS) {
+            std::cerr << "Expected condition but got nothing" << std::endl;
+            cond.emitConstant(false);
+        } else {
+            binary_condition(lexer, ctx, cond);
+        }
+        it = ctx.Conditions.emplace(expr, CachedCondition{ std::move(cond) }).first;
+        ++ctx.ConditionsCompiled;
+    }
+
+    CachedCondition& cached = it->second;
+    bool constant;
+    if (cached.Program.isConstant(constant)) {
+        ++ctx.ConditionsConstant;
+        value = constant ? configs : 0;
+        return true;
+    }
+
+    if (cached.Epoch != ctx.Epoch) {
+        cached.Epoch = ctx.Epoch;
+        cached.Known = 0;
+    } else if ((cached.Known & configs) == configs) {
+        ++ctx.ConditionsMemoized;
+        value = cached.Values & configs;
+        return true;
+    }
+
+    for (size_t i = 0; i < ctx.Tags.size(); ++i) {
+        const ConfigMask bit = 1 << i;
+        if (!(configs & bit) || (cached.Known & bit))
+            continue;
+
+        ++ctx.ConditionsEvaluated;
+        if (cached.Program.evaluate(ctx.Tags[i]))
+            cached.Values |= bit;
+        else
+            cached.Values &= ~bit;
+        cached.Known |= bit;
+    }
+    value = cached.Values & configs;
+    return true;
+}
+
+#ifndef STPP_LIBRARY
+// Profiles
+// A profile only records the statistical shape of an input, never its content.
+// Line lengths and expression terms use power of two buckets, keyed by the lower bound of the bucket. Depths are exact.
+constexpr const char* PROFILE_HEADER = "stpp-profile 1";
+constexpr size_t OPERATION_COUNT     = static_cast<size_t>(Operation::Unknown) + 1;
+constexpr const char* OPERATION_NAMES[OPERATION_COUNT] = { "if", "elif", "else", "endif", "define", "undef", "unknown" };
+
+using Histogram = std::map<size_t, size_t>;
+
+struct Profile {
+    size_t Lines = 0;
+    Histogram LineLengths;
+    Histogram Depths;
+    Histogram ExpressionTerms;
+    size_t Directives[OPERATION_COUNT] = {};
+    size_t Ands                        = 0;
+    size_t Ors                         = 0;
+    size_t Xors                        = 0;
+    size_t Nots                        = 0;
+    size_t Parantheses                 = 0;
+    size_t Tags                        = 0;
+    size_t TagReferences               = 0;
+};
+
+inline size_t histogram_bucket(size_t value)
+{
+    size_t bucket = 1;
+    if (value == 0)
+        return 0;
+    while (bucket <= value / 2)
+        bucket *= 2;
+    return bucket;
+}
+
+bool profile(std::istream& in, std::ostream& out)
+{
+    Profile profile;
+    std::unordered_set<std::string> tags; // Only used for counting, never written
+
+    size_t depth = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        ++profile.Lines;
+        ++profile.LineLengths[histogram_bucket(line.size())];
+        ++profile.Depths[depth];
+
+        size_t pos = line.find(PP_START);
+        while (pos != std::string::npos) {
+            size_t start = pos + 1;
+            while (start < line.size() && std::isspace(line[start]))
+                ++start;
+            size_t end = start;
+            while (end < line.size() && end - start < MAX_OPERATION_SIZE && !std::isspace(line[end]))
+                ++end;
+
+            const Operation op = to_operation(std::string_view(line).substr(start, end - start));
+            ++profile.Directives[static_cast<size_t>(op)];
+
+            if (op == Operation::If || op == Operation::Elif) {
+                ExprLexer lexer(std::string_view(line).substr(end), false);
+                size_t terms = 0;
+                for (; lexer.current().Type != TokenType::EOS; lexer.accept()) {
+                    const Token token = lexer.current();
+                    switch (token.Type) {
+                    case TokenType::Tag:
+                        ++terms;
+                        ++profile.TagReferences;
+                        tags.emplace(token.Tag);
+                        break;
+                    case TokenType::ParantheseOpen:
+                        ++profile.Parantheses;
+                        break;
+                    case TokenType::And:
+                        ++profile.Ands;
+                        break;
+                    case TokenType::Or:
+                        ++profile.Ors;
+                        break;
+                    case TokenType::Xor:
+                        ++profile.Xors;
+                        break;
+                    case TokenType::Not:
+                        ++profile.Nots;
+                        break;
+                    default:
+                        break;
+                    }
+                }
+                ++profile.ExpressionTerms[histogram_bucket(terms)];
+                if (op == Operation::If)
+                    ++depth;
+                break; // The rest of the line is the expression
+            } else if (op == Operation::Endif) {
+                if (depth > 0)
+                    --depth;
+            } else if (op == Operation::Define || op == Operation::Undef) {
+                std::istringstream stream(line.substr(end));
+                std::string tag;
+                if (stream >> tag) {
+                    ++profile.TagReferences;
+                    tags.insert(tag);
+                }
+            }
+
+            pos = line.find(PP_START, end);
+        }
+    }
+    profile.Tags = tags.size();
+
+    const auto write_histogram = [&](const char* name, const Histogram& histogram) {
+        for (const auto& entry : histogram)
+            out << name << " " << entry.first << " " << entry.second << "\n";
+    };
+
+    out << PROFILE_HEADER << "\n"
+        << "lines " << profile.Lines << "\n";
+    write_histogram("line_length", profile.LineLengths);
+    write_histogram("depth", profile.Depths);
+    write_histogram("expression_terms", profile.ExpressionTerms);
+    for (size_t i = 0; i < OPERATION_COUNT; ++i)
+        out << "directive " << OPERATION_NAMES[i] << " " << profile.Directives[i] << "\n";
+    out << "operator and " << profile.Ands << "\n"
+        << "operator or " << profile.Ors << "\n"
+        << "operator xor " << profile.Xors << "\n"
+        << "operator not " << profile.Nots << "\n"
+        << "operator parantheses " << profile.Parantheses << "\n"
+        << "tags " << profile.Tags << "\n"
+        << "tag_references " << profile.TagReferences << "\n";
+    return out.good();
+}
+
+bool read_profile(std::istream& in, Profile& profile)
+{
+    std::string line;
+    if (!std::getline(in, line) || line != PROFILE_HEADER) {
+        std::cerr << "Input is not a stpp profile" << std::endl;
+        return false;
+    }
+
+    while (std::getline(in, line)) {
+        std::istringstream stream(line);
+        std::string key;
+        if (!(stream >> key))
+            continue;
+
+        size_t bucket = 0;
+        size_t value  = 0;
+        if (key == "lines") {
+            stream >> profile.Lines;
+        } else if (key == "line_length" && stream >> bucket >> value) {
+            profile.LineLengths[bucket] = value;
+        } else if (key == "depth" && stream >> bucket >> value) {
+            profile.Depths[bucket] = value;
+        } else if (key == "expression_terms" && stream >> bucket >> value) {
+            profile.ExpressionTerms[bucket] = value;
+        } else if (key == "directive" || key == "operator") {
+            std::string name;
+            stream >> name >> value;
+            for (size_t i = 0; i < OPERATION_COUNT; ++i) {
+                if (key == "directive" && name == OPERATION_NAMES[i])
+                    profile.Directives[i] = value;
+            }
+            if (name == "and")
+                profile.Ands = value;
+            else if (name == "or")
+                profile.Ors = value;
+            else if (name == "xor")
+                profile.Xors = value;
+            else if (name == "not")
+                profile.Nots = value;
+            else if (name == "parantheses")
+                profile.Parantheses = value;
+        } else if (key == "tags") {
+            stream >> profile.Tags;
+        } else if (key == "tag_references") {
+            stream >> profile.TagReferences;
+        }
+    }
+
+    return true;
+}
+
+class ProfileGenerator {
+public:
+    ProfileGenerator(const Profile& profile, uint32_t seed)
+        : mProfile(profile)
+        , mRandom(seed)
+    {
+        mTerms = profile.TagReferences > 0 ? profile.TagReferences : 1;
+    }
+
+    bool generate(std::ostream& out)
+    {
+        const size_t maxDepth = mProfile.Depths.empty() ? 0 : mProfile.Depths.rbegin()->first;
+
+        std::vector<double> weights(OPERATION_COUNT + 1);
+        weights[OPERATION_COUNT] = static_cast<double>(mProfile.Lines); // Plain text
+        for (size_t i = 0; i < OPERATION_COUNT; ++i) {
+            weights[i] = static_cast<double>(mProfile.Directives[i]);
+            weights[OPERATION_COUNT] -= weights[i];
+        }
+        weights[OPERATION_COUNT] = std::max(weights[OPERATION_COUNT], 1.0);
+        std::discrete_distribution<size_t> directive(weights.begin(), weights.end());
+
+        std::vector<bool> hasElse; // Per open block
+        std::vector<size_t> depths(maxDepth + 1, 0);
+        for (size_t line = 0; line < mProfile.Lines; ++line) {
+            const size_t depth = hasElse.size();
+            ++depths[depth];
+
+            const size_t choice = directive(mRandom);
+            Operation op        = choice < OPERATION_COUNT ? static_cast<Operation>(choice) : Operation::Unknown;
+            const bool text     = choice >= OPERATION_COUNT;
+
+            // Open or close blocks, depending on which neighbouring depth is less represented than recorded
+            if (!text && (op == Operation::If || op == Operation::Endif)) {
+                const double deeper    = depth < maxDepth ? deficit(depths, depth + 1, line) : -1;
+                const double shallower = depth > 0 ? deficit(depths, depth - 1, line) : -1;
+                op                     = deeper >= shallower ? Operation::If : Operation::Endif;
+            }
+
+            if (text) {
+                out << this->text() << "\n";
+            } else if (op == Operation::If && depth < maxDepth) {
+                out << PP_START << "if " << expression() << "\n";
+                hasElse.push_back(false);
+            } else if (op == Operation::Elif && !hasElse.empty() && !hasElse.back()) {
+                out << PP_START << "elif " << expression() << "\n";
+            } else if (op == Operation::Else && !hasElse.empty() && !hasElse.back()) {
+                out << PP_START << "else\n";
+                hasElse.back() = true;
+            } else if (op == Operation::Endif && !hasElse.empty()) {
+                out << PP_START << "endif\n";
+                hasElse.pop_back();
+            } else if (op == Operation::Define || op == Operation::Undef) {
+                out << PP_START << (op == Operation::Define ? "define " : "undef ") << tag() << "\n";
+            } else if (op == Operation::Unknown) {
+                out << PP_START << "note " << this->text() << "\n";
+            } else {
+                out << this->text() << "\n";
+            }
+        }
+
+        for (; !hasElse.empty(); hasElse.pop_back())
+            out << PP_START << "endif\n";
+
+        return out.good();
+    }
+
+private:
+    double deficit(const std::vector<size_t>& depths, size_t depth, size_t lines) const
+    {
+        const auto it        = mProfile.Depths.find(depth);
+        const double recorded = it == mProfile.Depths.end() ? 0 : static_cast<double>(it->second);
+        return recorded / std::max<size_t>(mProfile.Lines, 1) - static_cast<double>(depths[depth]) / (lines + 1);
+    }
+
+    size_t sample(const Histogram& histogram)
+    {
+        if (histogram.empty())
+            return 0;
+
+        std::vector<double> weights;
+        for (const auto& entry : histogram)
+            weights.push_back(static_cast<double>(entry.second));
+        std::discrete_distribution<size_t> bucket(weights.begin(), weights.end());
+
+        const size_t index = bucket(mRandom);
+        const size_t lower = std::next(histogram.begin(), index)->first;
+        const size_t upper = std::max<size_t>(lower * 2, 1);
+        return std::uniform_int_distribution<size_t>(lower, upper - 1)(mRandom);
+    }
+
+    bool chance(size_t count)
+    {
+        return std::uniform_real_distribution<double>(0, 1)(mRandom) * mTerms < count;
+    }
+
+    std::string tag()
+    {
+        const size_t tags = std::max<size_t>(mProfile.Tags, 1);
+        return "TAG" + std::to_string(std::uniform_int_distribution<size_t>(0, tags - 1)(mRandom));
+    }
+
+    std::string text()
+    {
+        const size_t length = sample(mProfile.LineLengths);
+        std::string line;
+        line.reserve(length);
+        while (line.size() < length) {
+            if (!line.empty())
+                line += ' ';
+            line += "lorem";
+        }
+        line.resize(length);
+        return line;
+    }
+
+    // Parantheses are profiled but not generated, a tag in parantheses is no valid condition
+    std::string expression()
+    {
+        const size_t terms = std::max<size_t>(sample(mProfile.ExpressionTerms), 1);
+
+        std::vector<double> weights = { static_cast<double>(mProfile.Ands), static_cast<double>(mProfile.Ors), static_cast<double>(mProfile.Xors) };
+        if (weights[0] + weights[1] + weights[2] <= 0)
+            weights[0] = 1;
+        std::discrete_distribution<size_t> binary(weights.begin(), weights.end());
+
+        static const char* OPERATORS[] = { " && ", " || ", " ^ " };
+        std::string expr;
+        for (size_t i = 0; i < terms; ++i) {
+            if (i > 0)
+                expr += OPERATORS[binary(mRandom)];
+            if (chance(mProfile.Nots))
+                expr += '!';
+            expr += tag();
+        }
+        return expr;
+    }
+
+    const Profile& mProfile;
+    std::mt19937 mRandom;
+    size_t mTerms;
+};
+
+bool generate(std::istream& in, std::ostream& out, uint32_t seed)
+{
+    Profile profile;
+    if (!read_profile(in, profile))
+        return false;
+
+    ProfileGenerator generator(profile, seed);
+    return generator.generate(out);
+}
+
+// Archives
+// Batch mode reads a tar stream, preprocesses all regular files in parallel and writes them in the original order.
+// All other entries (directories, links, extended headers) are passed through unchanged.
+constexpr size_t TAR_BLOCK_SIZE     = 512;
+constexpr size_t TAR_SIZE_OFFSET    = 124;
+constexpr size_t TAR_SIZE_LENGTH    = 12;
+constexpr size_t TAR_CHKSUM_OFFSET  = 148;
+constexpr size_t TAR_CHKSUM_LENGTH  = 8;
+constexpr size_t TAR_TYPE_OFFSET    = 156;
+constexpr size_t TAR_MAGIC_OFFSET   = 257;
+constexpr size_t TAR_PREFIX_OFFSET  = 345;
+constexpr size_t TAR_PREFIX_LENGTH  = 155;
+constexpr size_t TAR_NAME_LENGTH    = 100;
+constexpr size_t TAR_WINDOW_PER_JOB = 4;       // Entries kept in flight per job for the reorder buffer
+constexpr size_t TAR_READ_CHUNK     = 1 << 20; // Data is read in chunks, so a corrupt size never allocates more than the input holds
+
+struct TarEntry {
+    char Header[TAR_BLOCK_SIZE];
+    std::string Data;
+    std::unordered_set<std::string> Tags; // Referenced tags, if indexing
+    bool Failed = false;
+};
+
+inline uint64_t tar_read_number(const char* field, size_t size)
+{
+    uint64_t value = 0;
+    if (static_cast<unsigned char>(field[0]) & 0x80) { // Base-256 encoding for large values
+        value = static_cast<unsigned char>(field[0]) & 0x7F;
+        for (size_t i = 1; i < size; ++i)
+            value = (value << 8) | static_cast<unsigned char>(field[i]);
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < size && field[i] == ' ')
+        ++i;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i)
+        value = (value << 3) | static_cast<uint64_t>(field[i] - '0');
+    return value;
+}
+
+// Writes octal digits terminated by NUL if possible, base-256 encoding otherwise
+inline void tar_write_number(char* field, size_t size, uint64_t value)
+{
+    if (value < (uint64_t(1) << (3 * (size - 1)))) {
+        field[size - 1] = 0;
+        for (size_t i = size - 1; i > 0; --i) {
+            field[i - 1] = static_cast<char>('0' + (value & 7));
+            value >>= 3;
+        }
+    } else {
+        for (size_t i = size; i > 1; --i) {
+            field[i - 1] = static_cast<char>(value & 0xFF);
+            value >>= 8;
+        }
+        field[0] = static_cast<char>(0x80);
+    }
+}
+
+// Old archivers sum signed characters, both sums are accepted
+inline bool tar_check_header(const char* header)
+{
+    if (std::memcmp(header + TAR_MAGIC_OFFSET, "ustar", 5) != 0)
+        return false;
+
+    uint64_t sum      = 0;
+    int64_t signedSum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; ++i) {
+        const bool checksum = i >= TAR_CHKSUM_OFFSET && i < TAR_CHKSUM_OFFSET + TAR_CHKSUM_LENGTH; // Summed as spaces
+        const char c        = checksum ? ' ' : header[i];
+
+        sum += static_cast<unsigned char>(c);
+        signedSum += static_cast<signed char>(c);
+    }
+
+    const uint64_t stored = tar_read_number(header + TAR_CHKSUM_OFFSET, TAR_CHKSUM_LENGTH);
+    return stored == sum || static_cast<int64_t>(stored) == signedSum;
+}
+
+inline void tar_update_checksum(char* header)
+{
+    std::memset(header + TAR_CHKSUM_OFFSET, ' ', TAR_CHKSUM_LENGTH);
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; ++i)
+        sum += static_cast<unsigned char>(header[i]);
+
+    tar_write_number(header + TAR_CHKSUM_OFFSET, TAR_CHKSUM_LENGTH - 1, sum);
+    header[TAR_CHKSUM_OFFSET + TAR_CHKSUM_LENGTH - 1] = ' ';
+}
+
+inline std::string tar_name(const char* header)
+{
+    std::string name(header, strnlen(header, TAR_NAME_LENGTH));
+    if (std::memcmp(header + TAR_MAGIC_OFFSET, "ustar", 5) == 0 && header[TAR_PREFIX_OFFSET] != 0)
+        name = std::string(header + TAR_PREFIX_OFFSET, strnlen(header + TAR_PREFIX_OFFSET, TAR_PREFIX_LENGTH)) + "/" + name;
+    return name;
+}
+
+inline bool tar_is_regular(const char* header)
+{
+    const char type = header[TAR_TYPE_OFFSET];
+    return type == '0' || type == 0 || type == '7';
+}
+
+inline size_t tar_padding(size_t size)
+{
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+bool read_tar_entry(std::istream& in, TarEntry& entry, bool& end)
+{
+    if (!in.read(entry.Header, TAR_BLOCK_SIZE)) {
+        // Tolerate archives missing the end marker
+        end = true;
+        if (in.gcount() != 0)
+            std::cerr << "Truncated tar header" << std::endl;
+        return in.gcount() == 0;
+    }
+
+    end = std::all_of(entry.Header, entry.Header + TAR_BLOCK_SIZE, [](char c) { return c == 0; });
+    if (end)
+        return true;
+
+    if (!tar_check_header(entry.Header)) {
+        std::cerr << "Corrupt tar header" << std::endl;
+        return false;
+    }
+
+    // A size exceeding the archive runs out of data after at most one chunk, instead of allocating all of it up front
+    const uint64_t size = tar_read_number(entry.Header + TAR_SIZE_OFFSET, TAR_SIZE_LENGTH);
+    entry.Data.clear();
+    while (entry.Data.size() < size) {
+        const size_t offset = entry.Data.size();
+        entry.Data.resize(offset + static_cast<size_t>(std::min<uint64_t>(size - offset, TAR_READ_CHUNK)));
+        if (!in.read(&entry.Data[offset], static_cast<std::streamsize>(entry.Data.size() - offset))) {
+            std::cerr << "Truncated tar entry '" << tar_name(entry.Header) << "'" << std::endl;
+            return false;
+        }
+    }
+    in.ignore(tar_padding(size));
+
+    // The size of the next entry could be overridden, which would not match the preprocessed output
+    const char type = entry.Header[TAR_TYPE_OFFSET];
+    if ((type == 'x' || type == 'g') && entry.Data.find(" size=") != std::string::npos) {
+        std::cerr << "Extended tar headers with size records are not supported" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool write_tar_entry(std::ostream& out, const TarEntry& entry)
+{
+    static const char padding[TAR_BLOCK_SIZE] = {};
+
+    out.write(entry.Header, TAR_BLOCK_SIZE);
+    out.write(entry.Data.data(), entry.Data.size());
+    out.write(padding, tar_padding(entry.Data.size()));
+    return out.good();
+}
+
+void preprocess_tar_entry(TarEntry& entry, const Options& options)
+{
+    std::ostringstream out;
+    entry.Failed = !parse(entry.Data, out, options, options.IndexFile.empty() ? nullptr : &entry.Tags);
+    entry.Data   = out.str();
+
+    tar_write_number(entry.Header + TAR_SIZE_OFFSET, TAR_SIZE_LENGTH, entry.Data.size());
+    tar_update_checksum(entry.Header);
+}
+#endif
+
+// GNU make jobserver client
+// Every job owns one implicit token, each additional parallel job has to acquire a token from the jobserver.
+constexpr int JOBSERVER_POLL_MS = 50;
+
+class JobServer {
+public:
+    JobServer() = default;
+    JobServer(const JobServer&) = delete;
+    JobServer& operator=(const JobServer&) = delete;
+
+    ~JobServer()
+    {
+#if !defined(_WIN32)
+        if (mOwned)
+            close(mRead);
+#endif
+    }
+
+    // Connects to the jobserver announced by MAKEFLAGS. Returns false if none is available
+    bool connect()
+    {
+#if defined(_WIN32)
+        return false;
+#else
+        const char* env = std::getenv("MAKEFLAGS");
+        if (!env)
+            return false;
+
+        const std::string flags = env;
+        for (const char* key : { "--jobserver-auth=", "--jobserver-fds=" }) {
+            const size_t pos = flags.rfind(key); // The last one is the active one
+            if (pos == std::string::npos)
+                continue;
+
+            const size_t start = pos + strlen(key);
+            const std::string value = flags.substr(start, flags.find(' ', start) - start);
+            if (value.compare(0, 5, "fifo:") == 0) {
+                mRead  = open(value.substr(5).c_str(), O_RDWR | O_NONBLOCK);
+                mWrite = mRead;
+                mOwned = mRead >= 0;
+            } else if (std::sscanf(value.c_str(), "%d,%d", &mRead, &mWrite) != 2) {
+                mRead = mWrite = -1;
+            }
+
+            // Make closes the descriptors for commands not marked as recursive
+            if (mRead < 0 || fcntl(mRead, F_GETFD) < 0 || fcntl(mWrite, F_GETFD) < 0) {
+                std::cerr << "Jobserver announced but not accessible, running serially" << std::endl;
+                mRead = mWrite = -1;
+                mUnavailable   = true;
+                return false;
+            }
+
+            // Another client may take the token between poll() and read(), so the pipe has to be read without blocking.
+            // The inherited descriptor shares its flags with make, reading goes through a private reopened one instead
+            if (!mOwned) {
+                const int fd = open(("/proc/self/fd/" + std::to_string(mRead)).c_str(), O_RDONLY | O_NONBLOCK);
+                if (fd >= 0) {
+                    mRead  = fd;
+                    mOwned = true;
+                }
+            }
+            return true;
+        }
+        return false;
+#endif
+    }
+
+    // True if a jobserver was announced but could not be used
+    bool unavailable() const { return mUnavailable; }
+
+    // Blocks until a token is available. Gives up if cancelled() returns true or the jobserver fails
+    bool acquire(char& token, const std::function<bool()>& cancelled)
+    {
+#if defined(_WIN32)
+        (void)token;
+        (void)cancelled;
+        return false;
+#else
+        for (;;) {
+            if (cancelled())
+                return false;
+
+            pollfd pfd = { mRead, POLLIN, 0 };
+            const int ready = poll(&pfd, 1, JOBSERVER_POLL_MS);
+            if (ready < 0 && errno != EINTR)
+                return false;
+            if (ready <= 0)
+                continue;
+
+            // Tokens taken by another client leave the pipe empty again, poll for the next one
+            const ssize_t count = read(mRead, &token, 1);
+            if (count == 1)
+                return true;
+            if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                return false;
+        }
+#endif
+    }
+
+    void release(char token)
+    {
+#if !defined(_WIN32)
+        while (write(mWrite, &token, 1) < 0 && errno == EINTR)
+            ;
+#else
+        (void)token;
+#endif
+    }
+
+private:
+    int mRead         = -1;
+    int mWrite        = -1;
+    bool mOwned       = false;
+    bool mUnavailable = false;
+};
+
+class ThreadPool {
+public:
+    // If a jobserver is given, all workers but the first acquire a token for every task
+    explicit ThreadPool(size_t threads, JobServer* jobServer = nullptr)
+        : mJobServer(jobServer)
+    {
+        for (size_t i = 0; i < threads; ++i)
+            mWorkers.emplace_back([this, i]() { work(mJobServer && i > 0); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCondition.notify_all();
+        for (auto& worker : mWorkers)
+            worker.join();
+    }
+
+    std::future<void> submit(std::function<void()> func)
+    {
+        auto task   = std::make_shared<std::packaged_task<void()>>(std::move(func));
+        auto future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTasks.emplace_back([task]() { (*task)(); });
+        }
+        mCondition.notify_one();
+        return future;
+    }
+
+private:
+    void work(bool needsToken)
+    {
+        const auto idle = [this]() {
+            std::lock_guard<std::mutex> lock(mMutex);
+            return mTasks.empty();
+        };
+
+        for (;;) {
+            std::function<void()> task;
+            char token = 0;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this]() { return mStop || !mTasks.empty(); });
+                if (mTasks.empty())
+                    return;
+
+                if (needsToken) {
+                    lock.unlock();
+                    const bool acquired = mJobServer->acquire(token, idle);
+                    lock.lock();
+
+                    if (!acquired) {
+                        if (mTasks.empty())
+                            continue; // Other workers took care of it
+                        return;       // Jobserver failed, leave the work to the remaining workers
+                    }
+
+                    if (mTasks.empty()) {
+                        mJobServer->release(token);
+                        continue;
+                    }
+                }
+
+                task = std::move(mTasks.front());
+                mTasks.pop_front();
+            }
+
+            task();
+            if (needsToken)
+                mJobServer->release(token);
+        }
+    }
+
+    JobServer* mJobServer;
+    std::vector<std::thread> mWorkers;
+    std::deque<std::function<void()>> mTasks;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mStop = false;
+};
+
+#ifndef STPP_LIBRARY
+bool archive(std::istream& in, std::ostream& out, const Options& options)
+{
+    Options entryOptions = options;
+    entryOptions.Stats     = false; // Statistics are per file and would interleave
+    entryOptions.DropCache = false; // Entries are no files, the archives are dropped when done
+
+    JobServer jobServer;
+    const bool useJobServer = jobServer.connect();
+
+    size_t jobs = options.Jobs > 0 ? options.Jobs : std::max<size_t>(1, std::thread::hardware_concurrency());
+    if (jobServer.unavailable())
+        jobs = 1;
+    ThreadPool pool(jobs, useJobServer ? &jobServer : nullptr);
+
+    using Pending = std::pair<std::unique_ptr<TarEntry>, std::future<void>>;
+    std::deque<Pending> pending;
+    IndexUpdate update;
+
+    bool good              = true;
+    const auto write_front = [&]() {
+        Pending& front = pending.front();
+        front.second.get();
+        if (front.first->Failed) {
+            std::cerr << "Could not preprocess '" << tar_name(front.first->Header) << "'" << std::endl;
+            good = false;
+        }
+        if (!write_tar_entry(out, *front.first)) {
+            std::cerr << "Could not write tar entry '" << tar_name(front.first->Header) << "'" << std::endl;
+            good = false;
+        }
+        if (!options.IndexFile.empty() && tar_is_regular(front.first->Header))
+            update.emplace_back(tar_name(front.first->Header), std::move(front.first->Tags));
+        pending.pop_front();
+    };
+
+    for (;;) {
+        auto entry = std::make_unique<TarEntry>();
+        bool end   = false;
+        if (!read_tar_entry(in, *entry, end)) {
+            good = false;
+            break;
+        }
+        if (end)
+            break;
+
+        std::future<void> done;
+        if (tar_is_regular(entry->Header)) {
+            TarEntry* ptr = entry.get();
+            done          = pool.submit([ptr, &entryOptions]() { preprocess_tar_entry(*ptr, entryOptions); });
+        } else {
+            std::promise<void> passthrough;
+            passthrough.set_value();
+            done = passthrough.get_future();
+        }
+
+        pending.emplace_back(std::move(entry), std::move(done));
+        while (pending.size() >= jobs * TAR_WINDOW_PER_JOB)
+            write_front();
+    }
+
+    while (!pending.empty())
+        write_front();
+
+    // End of archive marker
+    static const char zeros[2 * TAR_BLOCK_SIZE] = {};
+    out.write(zeros, sizeof(zeros));
+
+    if (!options.IndexFile.empty() && !update_index(options.IndexFile, update))
+        good = false;
+    return good && out.good();
+}
+
+// Reverse index
+// Maps every tag to the files with conditions referencing it, as a plain text file with one "tag<TAB>file" line per pair.
+// Lines are sorted by tag and file, so consumers can binary search a mapped index.
+constexpr const char* INDEX_HEADER = "stpp-index 1";
+
+using ReverseIndex = std::map<std::string, std::set<std::string>>;
+
+bool read_index(const std::string& path, ReverseIndex& index)
+{
+    std::ifstream in(path);
+    if (!in)
+        return true; // Not created yet
+
+    std::string line;
+    if (!std::getline(in, line) || line != INDEX_HEADER) {
+        std::cerr << "'" << path << "' is not a stpp index" << std::endl;
+        return false;
+    }
+
+    while (std::getline(in, line)) {
+        const size_t sep = line.find('\t');
+        if (sep != std::string::npos)
+            index[line.substr(0, sep)].insert(line.substr(sep + 1));
+    }
+    return true;
+}
+
+// Serializes updates of concurrent processes, e.g. of a parallel make, through an exclusive lock on "<index>.lock"
+class IndexLock {
+public:
+    explicit IndexLock(const std::string& path)
+    {
+        const std::string lockPath = path + ".lock";
+#if defined(_WIN32)
+        mHandle = CreateFileA(lockPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (mHandle == INVALID_HANDLE_VALUE)
+            return;
+        OVERLAPPED overlapped = {};
+        mLocked               = LockFileEx(mHandle, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped) != 0;
+#else
+        mFd = ::open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (mFd < 0)
+            return;
+        int result;
+        do {
+            result = flock(mFd, LOCK_EX);
+        } while (result != 0 && errno == EINTR);
+        mLocked = result == 0;
+#endif
+    }
+
+    IndexLock(const IndexLock&) = delete;
+    IndexLock& operator=(const IndexLock&) = delete;
+
+    // Closing releases the lock
+    ~IndexLock()
+    {
+#if defined(_WIN32)
+        if (mHandle != INVALID_HANDLE_VALUE)
+            CloseHandle(mHandle);
+#else
+        if (mFd >= 0)
+            ::close(mFd);
+#endif
+    }
+
+    inline bool locked() const { return mLocked; }
+
+private:
+#if defined(_WIN32)
+    HANDLE mHandle = INVALID_HANDLE_VALUE;
+#else
+    int mFd = -1;
+#endif
+    bool mLocked = false;
+};
+
+// Only called with the index locked
+bool write_index(const std::string& path, const ReverseIndex& index)
+{
+    std::ostringstream content;
+    content << INDEX_HEADER << "\n";
+    for (const auto& entry : index) {
+        for (const auto& file : entry.second)
+            content << entry.first << "\t" << file << "\n";
+    }
+    const std::string data = content.str();
+
+    // Written to a temporary file in the same directory first, such that readers never see a partial index
+#if defined(_WIN32)
+    const std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::out | std::ios::binary);
+        out.write(data.data(), data.size());
+        if (!out.good()) {
+            std::cerr << "Could not write index '" << tmpPath << "'" << std::endl;
+            return false;
+        }
+    }
+
+    if (!MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        std::remove(tmpPath.c_str());
+        std::cerr << "Could not replace index '" << path << "'" << std::endl;
+        return false;
+    }
+#else
+    std::string tmpPath = path + ".XXXXXX";
+    const int fd        = mkstemp(&tmpPath[0]);
+    if (fd < 0) {
+        std::cerr << "Could not create temporary index '" << tmpPath << "'" << std::endl;
+        return false;
+    }
+
+    bool good = fchmod(fd, 0644) == 0; // mkstemp() only grants access to the owner
+    for (size_t written = 0; good && written < data.size();) {
+        const ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        good     = result > 0;
+        written += good ? static_cast<size_t>(result) : 0;
+    }
+    good = ::close(fd) == 0 && good;
+    if (!good) {
+        std::remove(tmpPath.c_str());
+        std::cerr << "Could not write index '" << tmpPath << "'" << std::endl;
+        return false;
+    }
+
+    // Atomically replaces the previous index
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        std::cerr << "Could not replace index '" << path << "'" << std::endl;
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool update_index(const std::string& path, const IndexUpdate& update)
+{
+    // Held across reading, merging and replacing, so no concurrent update is lost
+    IndexLock lock(path);
+    if (!lock.locked()) {
+        std::cerr << "Could not lock index '" << path << "'" << std::endl;
+        return false;
+    }
+
+    ReverseIndex index;
+    if (!read_index(path, index))
+        return false;
+
+    // Files processed again replace all their previous entries
+    std::unordered_set<std::string> files;
+    for (const auto& entry : update)
+        files.insert(entry.first);
+
+    for (auto it = index.begin(); it != index.end();) {
+        for (auto file = it->second.begin(); file != it->second.end();) {
+            if (files.count(*file))
+                file = it->second.erase(file);
+            else
+                ++file;
+        }
+
+        if (it->second.empty())
+            it = index.erase(it);
+        else
+            ++it;
+    }
+
+    for (const auto& entry : update) {
+        for (const auto& tag : entry.second)
+            index[tag].insert(entry.first);
+    }
+
+    return write_index(path, index);
+}
+
+bool query_index(const std::string& path, const std::vector<std::string>& tags, std::ostream& out)
+{
+    ReverseIndex index;
+    if (!read_index(path, index))
+        return false;
+
+    std::set<std::string> files;
+    for (const auto& tag : tags) {
+        const auto it = index.find(tag);
+        if (it != index.end())
+            files.insert(it->second.begin(), it->second.end());
+    }
+
+    for (const auto& file : files)
+        out << file << "\n";
+    return out.good();
+}
+// Annotations
+// Written as one "name<TAB>offset<TAB>length" line per annotation, in the order of the output.
+constexpr const char* ANNOTATIONS_HEADER = "stpp-annotations 1";
+
+bool write_annotations(const std::string& path, const std::vector<stpp::Annotation>& annotations)
+{
+    std::ofstream out(path);
+    out << ANNOTATIONS_HEADER << "\n";
+    for (const auto& annotation : annotations)
+        out << annotation.Name << "\t" << annotation.Offset << "\t" << annotation.Length << "\n";
+
+    if (!out.good()) {
+        std::cerr << "Could not write annotations '" << path << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
+#endif
+
+// Compiled templates
+// A template is compiled along the path preprocessing takes through active blocks, every block becomes a chain of branches
+// skipped by jumps. This matches preprocessing as long as no condition or tag contains a directive start, as
+// inactive blocks scan those as plain text. Such inputs are refused.
+// The artifact is used as is from a mapping, all integers are in native byte order:
+//     TemplateHeader, tag names, operations, condition instructions, string pool
+constexpr char TEMPLATE_MAGIC[8]       = { 's', 't', 'p', 'p', 't', 'p', 'l', '1' };
+constexpr uint32_t TEMPLATE_BYTE_ORDER = 0x01020304;
+
+struct TemplateHeader {
+    char Magic[8];
+    uint32_t ByteOrder;
+    uint32_t TagCount;
+    uint32_t OpCount;
+    uint32_t InstructionCount;
+    uint32_t PoolSize;
+    uint32_t Reserved;
+};
+
+struct TemplateString {
+    uint32_t Offset; // Into the string pool
+    uint32_t Size;
+};
+
+enum class TemplateOpCode : uint32_t {
+    Text,
+    If,
+    Elif,
+    Else,
+    Endif,
+    Define,
+    Undef,
+    Fail
+};
+
+struct TemplateOp {
+    TemplateOpCode Code;
+    uint32_t A;    // Text and Fail: pool offset, If and Elif: first instruction, Define and Undef: tag
+    uint32_t B;    // Text and Fail: size, If and Elif: instruction count
+    uint32_t Next; // If and Elif: next branch of the block
+    uint32_t End;  // If, Elif and Else: endif of the block, or the failure if the block is never closed
+};
+
+struct TemplateInstruction {
+    uint32_t Code; // OpCode
+    uint32_t Tag;
+};
+
+#ifndef STPP_LIBRARY
+class TemplateBuilder {
+public:
+    void text(const char* data, size_t size)
+    {
+        if (size == 0)
+            return;
+
+        // Literals only separated by skipped directives are merged
+        if (!mOps.empty() && mOps.back().Code == TemplateOpCode::Text && mOps.back().A + mOps.back().B == mPool.size())
+            mOps.back().B += static_cast<uint32_t>(size);
+        else
+            mOps.push_back(TemplateOp{ TemplateOpCode::Text, static_cast<uint32_t>(mPool.size()), static_cast<uint32_t>(size), 0, 0 });
+        mPool.append(data, size);
+    }
+
+    inline bool inBlock() const { return !mBlocks.empty(); }
+
+    void branch(TemplateOpCode code, const std::string& expr)
+    {
+        const uint32_t index = static_cast<uint32_t>(mOps.size());
+        if (code == TemplateOpCode::If) {
+            mBlocks.emplace_back();
+        } else {
+            mOps[mBlocks.back().back()].Next = index;
+            if (code == TemplateOpCode::Endif) {
+                for (const uint32_t branch : mBlocks.back())
+                    mOps[branch].End = index;
+                mBlocks.pop_back();
+                mOps.push_back(TemplateOp{ code, 0, 0, 0, 0 });
+                return;
+            }
+        }
+
+        TemplateOp op{ code, static_cast<uint32_t>(mInstructions.size()), 0, 0, 0 };
+        if (code != TemplateOpCode::Else) {
+            CompiledCondition cond;
+            ExprLexer lexer(expr);
+            if (lexer.current().Type == TokenType::EOS) {
+                std::cerr << "Expected condition but got nothing" << std::endl;
+                cond.emitConstant(false);
+            } else {
+                binary_condition(lexer, mContext, cond);
+            }
+            for (const Instruction& ins : cond.code())
+                mInstructions.push_back(TemplateInstruction{ static_cast<uint32_t>(ins.Code), ins.Tag });
+            op.B = static_cast<uint32_t>(cond.size());
+        }
+        mBlocks.back().push_back(index);
+        mOps.push_back(op);
+    }
+
+    void define(TemplateOpCode code, const std::string& tag)
+    {
+        mOps.push_back(TemplateOp{ code, mContext.Table.intern(tag), 0, 0, 0 });
+    }
+
+    void fail(const char* message)
+    {
+        mOps.push_back(TemplateOp{ TemplateOpCode::Fail, static_cast<uint32_t>(mPool.size()), static_cast<uint32_t>(strlen(message)), 0, 0 });
+        mPool += message;
+    }
+
+    // Blocks still open at the end of the input lead to the failure preprocessing reports
+    void finish()
+    {
+        if (mBlocks.empty())
+            return;
+
+        const uint32_t index = static_cast<uint32_t>(mOps.size());
+        for (const auto& block : mBlocks) {
+            mOps[block.back()].Next = index;
+            for (const uint32_t branch : block)
+                mOps[branch].End = index;
+        }
+        mBlocks.clear();
+        fail("Missing #endif at end of input");
+    }
+
+    bool write(std::ostream& out)
+    {
+        std::vector<TemplateString> tags;
+        for (const auto& name : mContext.Table.names()) {
+            tags.push_back(TemplateString{ static_cast<uint32_t>(mPool.size()), static_cast<uint32_t>(name.size()) });
+            mPool += name;
+        }
+
+        if (mPool.size() > UINT32_MAX || mOps.size() > UINT32_MAX || mInstructions.size() > UINT32_MAX) {
+            std::cerr << "Input too large for a compiled template" << std::endl;
+            return false;
+        }
+
+        TemplateHeader header;
+        std::memcpy(header.Magic, TEMPLATE_MAGIC, sizeof(header.Magic));
+        header.ByteOrder        = TEMPLATE_BYTE_ORDER;
+        header.TagCount         = static_cast<uint32_t>(tags.size());
+        header.OpCount          = static_cast<uint32_t>(mOps.size());
+        header.InstructionCount = static_cast<uint32_t>(mInstructions.size());
+        header.PoolSize         = static_cast<uint32_t>(mPool.size());
+        header.Reserved         = 0;
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(tags.data()), tags.size() * sizeof(TemplateString));
+        out.write(reinterpret_cast<const char*>(mOps.data()), mOps.size() * sizeof(TemplateOp));
+        out.write(reinterpret_cast<const char*>(mInstructions.data()), mInstructions.size() * sizeof(TemplateInstruction));
+        out.write(mPool.data(), mPool.size());
+        return out.good();
+    }
+
+private:
+    Context mContext; // Interns the tags, conditions are never folded
+    std::vector<TemplateOp> mOps;
+    std::vector<TemplateInstruction> mInstructions;
+    std::string mPool;
+    std::vector<std::vector<uint32_t>> mBlocks; // Branches of the open blocks
+};
+
+bool compile(std::string_view input, std::ostream& out)
+{
+    MemorySource source(input);
+    TemplateBuilder builder;
+
+    const char* data;
+    size_t size;
+    bool directive;
+    while (source.text(data, size, directive)) {
+        builder.text(data, size);
+        if (!directive)
+            continue;
+
+        const char* name;
+        size_t custom      = 0;
+        bool lineEnd       = false;
+        const Operation op = extract_operation(source, builtin_directives(), name, custom, lineEnd);
+        switch (op) {
+        case Operation::If:
+        case Operation::Elif: {
+            if (op == Operation::Elif && !builder.inBlock())
+                break;
+            const std::string expr = get_line(source);
+            if (expr.find(PP_START) != std::string::npos) {
+                std::cerr << "Conditions containing '" << PP_START << "' can not be compiled" << std::endl;
+                return false;
+            }
+            builder.branch(op == Operation::If ? TemplateOpCode::If : TemplateOpCode::Elif, expr);
+            continue;
+        }
+        case Operation::Else:
+        case Operation::Endif:
+            if (!builder.inBlock())
+                break;
+            builder.branch(op == Operation::Else ? TemplateOpCode::Else : TemplateOpCode::Endif, std::string());
+            continue;
+        case Operation::Define:
+        case Operation::Undef: {
+            const std::string tag = get_tag(source);
+            if (tag.find(PP_START) != std::string::npos) {
+                std::cerr << "Tags containing '" << PP_START << "' can not be compiled" << std::endl;
+                return false;
+            }
+            if (tag.empty())
+                builder.fail(op == Operation::Define ? "Define statement without tag" : "Undef statement without tag");
+            else
+                builder.define(op == Operation::Define ? TemplateOpCode::Define : TemplateOpCode::Undef, tag);
+            continue;
+        }
+        default:
+            break;
+        }
+
+        // FIXME: We lose the whitespaces....
+        builder.text("#", 1);
+        builder.text(name, strlen(name));
+    }
+
+    builder.finish();
+    return builder.write(out);
+}
+#endif
+
+// A template referring into a validated artifact
+struct TemplateView {
+    const TemplateString* Tags              = nullptr;
+    const TemplateOp* Ops                   = nullptr;
+    const TemplateInstruction* Instructions = nullptr;
+    const char* Pool                        = nullptr;
+    uint32_t TagCount                       = 0;
+    uint32_t OpCount                        = 0;
+};
+
+// Artifacts are validated once when loaded, such that rendering never leaves the artifact.
+// Jumps only lead forward to the next branch or the end of a block, therefore rendering always terminates.
+bool load_template(std::string_view data, TemplateView& view)
+{
+    TemplateHeader header;
+    if (data.size() < sizeof(header) || reinterpret_cast<uintptr_t>(data.data()) % alignof(TemplateOp) != 0)
+        return false;
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.Magic, TEMPLATE_MAGIC, sizeof(header.Magic)) != 0 || header.ByteOrder != TEMPLATE_BYTE_ORDER)
+        return false;
+
+    const uint64_t size = sizeof(header) + uint64_t(header.TagCount) * sizeof(TemplateString) + uint64_t(header.OpCount) * sizeof(TemplateOp)
+                        + uint64_t(header.InstructionCount) * sizeof(TemplateInstruction) + header.PoolSize;
+    if (size != data.size())
+        return false;
+
+    const char* pos   = data.data() + sizeof(header);
+    view.Tags         = reinterpret_cast<const TemplateString*>(pos);
+    pos              += header.TagCount * sizeof(TemplateString);
+    view.Ops          = reinterpret_cast<const TemplateOp*>(pos);
+    pos              += header.OpCount * sizeof(TemplateOp);
+    view.Instructions = reinterpret_cast<const TemplateInstruction*>(pos);
+    pos              += header.InstructionCount * sizeof(TemplateInstruction);
+    view.Pool         = pos;
+    view.TagCount     = header.TagCount;
+    view.OpCount      = header.OpCount;
+
+    const auto inPool = [&](uint32_t offset, uint32_t size) { return uint64_t(offset) + size <= header.PoolSize; };
+    for (uint32_t i = 0; i < header.TagCount; ++i) {
+        if (!inPool(view.Tags[i].Offset, view.Tags[i].Size))
+            return false;
+    }
+
+    for (uint32_t i = 0; i < header.OpCount; ++i) {
+        const TemplateOp& op = view.Ops[i];
+        const auto forward   = [&](uint32_t target, bool branch) {
+            if (target <= i || target >= header.OpCount)
+                return false;
+            const TemplateOpCode code = view.Ops[target].Code;
+            return code == TemplateOpCode::Endif || code == TemplateOpCode::Fail || (branch && (code == TemplateOpCode::Elif || code == TemplateOpCode::Else));
+        };
+        switch (op.Code) {
+        case TemplateOpCode::Text:
+        case TemplateOpCode::Fail:
+            if (!inPool(op.A, op.B))
+                return false;
+            break;
+        case TemplateOpCode::If:
+        case TemplateOpCode::Elif: {
+            if (!forward(op.Next, true) || !forward(op.End, false) || uint64_t(op.A) + op.B > header.InstructionCount)
+                return false;
+
+            // Every operand has to be on the stack
+            size_t depth = 0;
+            for (uint32_t j = op.A; j < op.A + op.B; ++j) {
+                const TemplateInstruction& ins = view.Instructions[j];
+                switch (static_cast<OpCode>(ins.Code)) {
+                case OpCode::Test:
+                    if (ins.Tag >= header.TagCount)
+                        return false;
+                    // fallthrough
+                case OpCode::False:
+                case OpCode::True:
+                    ++depth;
+                    break;
+                case OpCode::Not:
+                    if (depth < 1)
+                        return false;
+                    break;
+                case OpCode::And:
+                case OpCode::Or:
+                case OpCode::Xor:
+                    if (depth < 2)
+                        return false;
+                    --depth;
+                    break;
+                default:
+                    return false;
+                }
+            }
+        } break;
+        case TemplateOpCode::Else:
+            if (!forward(op.End, false))
+                return false;
+            break;
+        case TemplateOpCode::Define:
+        case TemplateOpCode::Undef:
+            if (op.A >= header.TagCount)
+                return false;
+            break;
+        case TemplateOpCode::Endif:
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// Only operations of taken branches are visited, so no block stack is needed
+template <typename Emit>
+bool render_template(const TemplateView& view, const std::vector<uint64_t>& bits, Emit emit)
+{
+    TagSet tags(bits);
+    std::vector<uint8_t> stack;
+    const auto taken = [&](const TemplateOp& op) {
+        return op.Code == TemplateOpCode::Else || evaluate_program(view.Instructions + op.A, op.B, tags, stack);
+    };
+
+    uint32_t pc = 0;
+    while (pc < view.OpCount) {
+        const TemplateOp& op = view.Ops[pc];
+        switch (op.Code) {
+        case TemplateOpCode::Text:
+            emit(view.Pool + op.A, op.B);
+            ++pc;
+            break;
+        case TemplateOpCode::If:
+            // Follows the branches until one is taken, the endif or the failure
+            while (view.Ops[pc].Code != TemplateOpCode::Endif && view.Ops[pc].Code != TemplateOpCode::Fail && !taken(view.Ops[pc]))
+                pc = view.Ops[pc].Next;
+            if (view.Ops[pc].Code != TemplateOpCode::Fail)
+                ++pc;
+            break;
+        case TemplateOpCode::Elif:
+        case TemplateOpCode::Else:
+            pc = op.End; // End of a taken branch
+            break;
+        case TemplateOpCode::Endif:
+            ++pc;
+            break;
+        case TemplateOpCode::Define:
+            tags.set(op.A);
+            ++pc;
+            break;
+        case TemplateOpCode::Undef:
+            tags.reset(op.A);
+            ++pc;
+            break;
+        case TemplateOpCode::Fail:
+            std::cerr.write(view.Pool + op.A, op.B) << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifndef STPP_LIBRARY
+// Replays an I/O trace with the recorded sizes against the given streams. Every operation takes at least as long as
+// recorded, which injects the latencies of the recorded storage into local files
+bool replay_io(const std::string& path, std::istream& in, std::ostream& out)
+{
+    std::ifstream trace(path);
+    std::string header;
+    if (!std::getline(trace, header) || header != IO_TRACE_HEADER) {
+        std::cerr << "Could not read I/O trace '" << path << "'" << std::endl;
+        return false;
+    }
+
+    size_t reads          = 0;
+    size_t writes         = 0;
+    uint64_t readBytes    = 0;
+    uint64_t writtenBytes = 0;
+    uint64_t recorded     = 0;
+    std::vector<char> buffer(IO_TRACE_BUFFER_SIZE); // Written content is irrelevant
+
+    const auto begin = std::chrono::steady_clock::now();
+    std::string op;
+    IoRecord record;
+    while (trace >> op >> record.Offset >> record.Size >> record.Micros) {
+        const auto start = std::chrono::steady_clock::now();
+        if (buffer.size() < record.Size)
+            buffer.resize(record.Size);
+
+        if (op == "r") {
+            in.read(buffer.data(), static_cast<std::streamsize>(record.Size));
+            readBytes += static_cast<uint64_t>(in.gcount());
+            in.clear(); // The local input may be shorter
+            ++reads;
+        } else if (op == "w") {
+            out.write(buffer.data(), static_cast<std::streamsize>(record.Size));
+            out.flush();
+            writtenBytes += record.Size;
+            ++writes;
+        } else if (op == "s") {
+            in.clear();
+            in.seekg(static_cast<std::streamoff>(record.Offset));
+        } else {
+            std::cerr << "Unknown operation '" << op << "' in I/O trace '" << path << "'" << std::endl;
+            return false;
+        }
+
+        recorded += record.Micros;
+        std::this_thread::sleep_until(start + std::chrono::microseconds(record.Micros));
+    }
+
+    if (!trace.eof()) {
+        std::cerr << "Malformed I/O trace '" << path << "'" << std::endl;
+        return false;
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    std::cerr << "Replayed " << reads << " reads of " << readBytes << " bytes and " << writes << " writes of " << writtenBytes << " bytes in "
+              << elapsed.count() << " s, recorded " << recorded / 1e6 << " s" << std::endl;
+    return out.good();
+}
+
+// Benchmarks
+// Every benchmark runs repeatedly after warming up, on the given CPU if any. Samples further than three scaled median
+// absolute deviations from the median are rejected as outliers. Results are compared against a saved baseline by
+// Welch's t-test, so only differences beyond the noise of both are reported. Differences also have to exceed
+// BENCH_THRESHOLD of the baseline, such that small but consistent shifts do not fail a build.
+// Baselines are written as one "name<TAB>samples<TAB>mean<TAB>deviation" line per benchmark, in seconds.
+constexpr const char* BENCH_HEADER = "stpp-bench 1";
+constexpr double BENCH_THRESHOLD    = 0.02;
+
+struct BenchResult {
+    std::string Name;
+    size_t Samples   = 0;
+    double Mean      = 0;
+    double Deviation = 0; // Sample standard deviation
+};
+
+// Discards everything, keeping output and diagnostics out of the measurements
+class NullBuffer : public std::streambuf {
+protected:
+    int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+    std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+};
+
+// Reads a buffer in place, such that repeated runs do not copy their input
+class MemoryBuffer : public std::streambuf {
+public:
+    explicit MemoryBuffer(std::string_view data)
+    {
+        char* begin = const_cast<char*>(data.data()); // Never written through
+        setg(begin, begin, begin + data.size());
+    }
+};
+
+bool pin_to_cpu(int cpu)
+{
+#if defined(_WIN32)
+    return cpu < 64 && SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+// Two-sided 95% quantile of Student's t-distribution
+double t_quantile(double freedom)
+{
+    static const double TABLE[] = { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131,
+                                    2.120,  2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+    if (freedom < 1)
+        return TABLE[0];
+    if (freedom <= 30)
+        return TABLE[static_cast<size_t>(freedom) - 1]; // Rounded down, which is conservative
+    return 1.96 + 2.4 / freedom;
+}
+
+double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    const size_t n = values.size();
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+void reject_outliers(std::vector<double>& samples)
+{
+    const double center = median(samples);
+    std::vector<double> deviations;
+    for (const double sample : samples)
+        deviations.push_back(std::abs(sample - center));
+
+    const double mad = 1.4826 * median(deviations); // Scaled to the standard deviation of normal distributions
+    if (mad == 0)
+        return;
+    samples.erase(std::remove_if(samples.begin(), samples.end(), [&](double sample) { return std::abs(sample - center) > 3 * mad; }), samples.end());
+}
+
+template <typename Run>
+bool measure(const char* name, const Options& options, Run run, BenchResult& result)
+{
+    // The first run shows its diagnostics, all others are silenced
+    if (!run()) {
+        std::cerr << "Benchmark '" << name << "' failed" << std::endl;
+        return false;
+    }
+
+    NullBuffer null;
+    std::streambuf* errors = std::cerr.rdbuf(&null);
+    const auto failed      = [&](const char* phase, size_t i) {
+        std::cerr.rdbuf(errors);
+        std::cerr << "Benchmark '" << name << "' failed in " << phase << " run " << i + 1 << std::endl;
+        return false;
+    };
+
+    for (size_t i = 0; i < options.BenchWarmup; ++i) {
+        if (!run())
+            return failed("warmup", i);
+    }
+
+    std::vector<double> samples;
+    for (size_t i = 0; i < options.BenchRuns; ++i) {
+        const auto start                            = std::chrono::steady_clock::now();
+        const bool succeeded                        = run();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (!succeeded)
+            return failed("measured", i);
+        samples.push_back(elapsed.count());
+    }
+    std::cerr.rdbuf(errors);
+
+    reject_outliers(samples);
 
+    result.Name    = name;
+    result.Samples = samples.size();
+    result.Mean    = 0;
+    for (const double sample : samples)
+        result.Mean += sample;
+    result.Mean /= samples.size();
+
+    result.Deviation = 0;
+    for (const double sample : samples)
+        result.Deviation += (sample - result.Mean) * (sample - result.Mean);
+    result.Deviation = samples.size() > 1 ? std::sqrt(result.Deviation / (samples.size() - 1)) : 0;
     return true;
 }
 
-std::string get_tag(std::istream& in)
+bool read_baseline(const std::string& path, std::vector<BenchResult>& baseline)
 {
-    std::string buffer;
-    bool started = false;
-    char c;
-    while (in.get(c)) {
-        if (c == '\n')
-            break;
-        if (!std::isspace(c)) {
-            buffer += c;
-            started = true;
-        } else if (started) {
-            break;
-        }
+    std::ifstream in(path);
+    std::string header;
+    if (!std::getline(in, header) || header != BENCH_HEADER) {
+        std::cerr << "Could not read benchmark baseline '" << path << "'" << std::endl;
+        return false;
     }
-    return buffer;
+
+    BenchResult result;
+    while (in >> result.Name >> result.Samples >> result.Mean >> result.Deviation)
+        baseline.push_back(result);
+
+    if (!in.eof()) {
+        std::cerr << "Malformed benchmark baseline '" << path << "'" << std::endl;
+        return false;
+    }
+    return true;
 }
 
-bool handle_define(std::istream& in, Context& ctx)
+bool write_baseline(const std::string& path, const std::vector<BenchResult>& results)
 {
-    const std::string tag = get_tag(in);
-    if (tag.empty()) {
-        std::cerr << "Define statement without tag" << std::endl;
+    std::ofstream out(path);
+    out << BENCH_HEADER << "\n" << std::setprecision(9);
+    for (const auto& result : results)
+        out << result.Name << "\t" << result.Samples << "\t" << result.Mean << "\t" << result.Deviation << "\n";
+
+    if (!out.good()) {
+        std::cerr << "Could not write benchmark baseline '" << path << "'" << std::endl;
         return false;
-    } else {
-        ctx.Tags.insert(tag);
-        return true;
     }
+    return true;
 }
 
-bool handle_undef(std::istream& in, Context& ctx)
+// Returns false on errors and on significant regressions against the baseline
+bool benchmark(std::string_view input, std::ostream& out, const Options& options)
 {
-    const std::string tag = get_tag(in);
-    if (tag.empty()) {
-        std::cerr << "Undef statement without tag" << std::endl;
+    if (options.BenchRuns < 2) {
+        std::cerr << "Benchmarks need at least two runs" << std::endl;
+        return false;
+    }
+    if (options.BenchCpu >= 0 && !pin_to_cpu(options.BenchCpu))
+        std::cerr << "Could not pin to CPU " << options.BenchCpu << ", running unpinned" << std::endl;
+
+    std::vector<BenchResult> baseline;
+    if (!options.BaselineFile.empty() && !read_baseline(options.BaselineFile, baseline))
         return false;
+
+    Options runOptions   = options;
+    runOptions.Stats     = false;
+    runOptions.DropCache = false; // Runs repeat on the same input
+    NullBuffer null;
+    std::ostream discard(&null);
+
+    std::vector<BenchResult> results;
+    std::vector<size_t> threads; // Per result, zero for single threaded benchmarks
+    const bool tar = input.size() >= TAR_BLOCK_SIZE && tar_check_header(input.data());
+    if (tar) {
+        // Batch mode at doubling thread counts up to all cores, for the speedup over a single thread
+        runOptions.IndexFile.clear();
+        const size_t cores = std::max<size_t>(1, std::thread::hardware_concurrency());
+        if (options.BenchCpu >= 0)
+            std::cerr << "Workers inherit the pinned CPU, the speedup is limited to one core" << std::endl;
+        const auto batch = [&]() {
+            MemoryBuffer buffer(input);
+            std::istream in(&buffer);
+            return archive(in, discard, runOptions);
+        };
+        for (size_t count = 1;; count = std::min(2 * count, cores)) {
+            runOptions.Jobs        = count;
+            const std::string name = "archive-" + std::to_string(count);
+            results.emplace_back();
+            threads.push_back(count);
+            if (!measure(name.c_str(), options, batch, results.back()))
+                return false;
+            if (count == cores)
+                break;
+        }
     } else {
-        ctx.Tags.erase(tag);
-        return true;
+        results.resize(2);
+        threads.resize(2, 0);
+        const auto scan = [&]() {
+            std::unordered_set<std::string> mutableTags;
+            std::unordered_set<std::string> conditionTags;
+            scan_directives(input, mutableTags, &conditionTags);
+            return true;
+        };
+        const auto preprocess = [&]() { return parse(input, discard, runOptions); };
+        if (!measure("scan", options, scan, results[0]) || !measure("preprocess", options, preprocess, results[1]))
+            return false;
+    }
+
+    bool regressed = false;
+    out << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& result = results[i];
+        const double interval     = t_quantile(double(result.Samples - 1)) * result.Deviation / std::sqrt(double(result.Samples));
+        out << std::left << std::setw(12) << result.Name << std::right << std::setw(10) << result.Mean * 1e3 << " ms +- " << std::setw(6)
+            << 100 * interval / result.Mean << "%  " << std::setw(10) << input.size() / result.Mean / 1e6 << " MB/s  (" << result.Samples << " of "
+            << options.BenchRuns << " runs)\n";
+        if (threads[i] > 1) {
+            const double speedup = results[0].Mean / result.Mean;
+            out << std::setw(12) << "" << std::setw(10) << speedup << "x speedup, " << std::setw(6) << 100 * speedup / threads[i] << "% efficiency\n";
+        }
+
+        const auto it = std::find_if(baseline.begin(), baseline.end(), [&](const BenchResult& entry) { return entry.Name == result.Name; });
+        if (it == baseline.end() || it->Samples < 2)
+            continue;
+
+        // Welch's t-test with the Welch-Satterthwaite degrees of freedom
+        const double a         = it->Deviation * it->Deviation / it->Samples;
+        const double b         = result.Deviation * result.Deviation / result.Samples;
+        const double error     = std::sqrt(a + b);
+        const double freedom   = error > 0 ? (a + b) * (a + b) / (a * a / (it->Samples - 1) + b * b / (result.Samples - 1)) : 1;
+        const double change    = result.Mean - it->Mean;
+        const double margin    = t_quantile(freedom) * error;
+        const bool significant = std::abs(change) > margin && std::abs(change) > BENCH_THRESHOLD * it->Mean;
+        regressed              = regressed || (significant && change > 0);
+
+        out << std::setw(12) << "" << std::showpos << std::setw(10) << 100 * change / it->Mean << std::noshowpos << "% +- " << std::setw(6)
+            << 100 * margin / it->Mean << "%  against the baseline"
+            << (significant ? (change > 0 ? ", regression" : ", improvement") : ", no significant change") << "\n";
     }
+
+    if (!options.SaveBaselineFile.empty() && !write_baseline(options.SaveBaselineFile, results))
+        return false;
+    return out.good() && !regressed;
 }
+#endif
+} // namespace
 
-// Expressions
-enum class TokenType {
-    Tag,
-    ParantheseOpen,
-    ParantheseClose,
-    And,
-    Or,
-    Xor,
-    Not,
-    EOS
+// Library interface
+struct stpp::DirectiveRegistry::Implementation {
+    DirectiveTable Table;
+    std::vector<DirectiveHandler> Handlers;
 };
 
-struct Token {
-    TokenType Type;
-    std::string Tag;
+stpp::DirectiveRegistry::DirectiveRegistry()
+    : mImplementation(std::make_unique<Implementation>())
+{
+}
+
+stpp::DirectiveRegistry::~DirectiveRegistry() = default;
+
+bool stpp::DirectiveRegistry::add(std::string_view keyword, DirectiveHandler handler)
+{
+    if (!handler || !mImplementation->Table.add(keyword))
+        return false;
+    mImplementation->Handlers.push_back(std::move(handler));
+    return true;
+}
+
+struct stpp::TagProviders::Implementation {
+    struct Entry {
+        TagProvider Provider;
+        std::once_flag Computed;
+        bool Value = false;
+    };
+    std::unordered_map<std::string, std::unique_ptr<Entry>> Entries;
 };
 
-class ExprLexer {
-public:
-    ExprLexer(std::istream& in)
-        : mPosition(0)
+stpp::TagProviders::TagProviders()
+    : mImplementation(std::make_unique<Implementation>())
+{
+}
+
+stpp::TagProviders::~TagProviders() = default;
+
+bool stpp::TagProviders::add(std::string_view tag, TagProvider provider)
+{
+    if (tag.empty() || !provider)
+        return false;
+
+    auto entry      = std::make_unique<Implementation::Entry>();
+    entry->Provider = std::move(provider);
+    return mImplementation->Entries.emplace(std::string(tag), std::move(entry)).second;
+}
+
+bool stpp::TagProviders::resolve(std::string_view tag, bool& value) const
+{
+    const auto it = mImplementation->Entries.find(std::string(tag));
+    if (it == mImplementation->Entries.end())
+        return false;
+
+    Implementation::Entry& entry = *it->second;
+    std::call_once(entry.Computed, [&entry] { entry.Value = entry.Provider(); });
+    value = entry.Value;
+    return true;
+}
+
+struct stpp::SpanGenerator::Implementation {
+    explicit Implementation(std::string_view input)
+        : Source(input)
+        , Runner(Source, State)
     {
-        std::string tag;
-        auto checkAddTag = [&]() {
-            if (!tag.empty())
-                mTokens.push_back(Token{ TokenType::Tag, tag });
-            tag.clear();
-        };
+        State.Annotations = &Annotations;
+    }
 
-        char c;
-        while (in.get(c)) {
-            if (c == '\n')
-                break;
-            else if (std::isspace(c)) {
-                checkAddTag();
-            } else if (c == '!') {
-                checkAddTag();
-                mTokens.push_back(Token{ TokenType::Not, "" });
-            } else if (c == '^') {
-                checkAddTag();
-                mTokens.push_back(Token{ TokenType::Xor, "" });
-            } else if (c == '(') {
-                checkAddTag();
-                mTokens.push_back(Token{ TokenType::ParantheseOpen, "" });
-            } else if (c == ')') {
-                checkAddTag();
-                mTokens.push_back(Token{ TokenType::ParantheseClose, "" });
-            } else if (c == '&') {
-                checkAddTag();
-                in.get(c);
-                if (c == '&')
-                    mTokens.push_back(Token{ TokenType::And, "" });
-                else {
-                    std::cerr << "And operator is && not &" << std::endl;
-                    mTokens.push_back(Token{ TokenType::And, "" });
-                    in.unget();
-                }
-            } else if (c == '|') {
-                checkAddTag();
-                in.get(c);
-                if (c == '|')
-                    mTokens.push_back(Token{ TokenType::Or, "" });
-                else {
-                    std::cerr << "Or operator is || not |" << std::endl;
-                    mTokens.push_back(Token{ TokenType::Or, "" });
-                    in.unget();
-                }
-            } else {
-                tag += c;
-            }
-        }
+    std::vector<Annotation> Annotations;
+    Context State;
+    MemorySource Source;
+    Engine<MemorySource> Runner;
+};
 
-        checkAddTag(); // Add possible trailing tags
+stpp::SpanGenerator::SpanGenerator(std::string_view input, const std::unordered_set<std::string>& tags, const DirectiveRegistry* directives,
+                                   const TagProviders* providers)
+    : mImplementation(std::make_unique<Implementation>(input))
+{
+    Context& context = mImplementation->State;
+    if (directives) {
+        context.Directives = &directives->mImplementation->Table;
+        context.Handlers   = &directives->mImplementation->Handlers;
     }
+    context.Providers = providers;
 
-    bool accept(TokenType type)
-    {
-        const bool good = current().Type == type;
-        if (!good)
-            std::cerr << "Expected '" << tokenStr(type) << "' but got '" << tokenStr(current().Type) << "'" << std::endl;
-        ++mPosition;
-        return good;
+    context.Tags.resize(1);
+    for (const auto& tag : tags) {
+        const TagID id = context.Table.intern(tag);
+        context.Tags[0].set(id);
+        context.Resolved.set(id);
     }
 
-    void accept()
-    {
-        ++mPosition;
+    std::unordered_set<std::string> mutableTags;
+    scan_directives(input, mutableTags, nullptr);
+    fold_tags(context, mutableTags);
+}
+
+stpp::SpanGenerator::SpanGenerator(SpanGenerator&& other) noexcept = default;
+stpp::SpanGenerator& stpp::SpanGenerator::operator=(SpanGenerator&& other) noexcept = default;
+stpp::SpanGenerator::~SpanGenerator()                                                  = default;
+
+bool stpp::SpanGenerator::next(Span& span)
+{
+    OutputSpan output;
+    if (!mImplementation->Runner.next(output))
+        return false;
+
+    span.Data = output.Data;
+    span.Size = output.Size;
+    return true;
+}
+
+bool stpp::SpanGenerator::failed() const
+{
+    return mImplementation->Runner.failed();
+}
+
+const std::vector<stpp::Annotation>& stpp::SpanGenerator::annotations() const
+{
+    return mImplementation->Annotations;
+}
+
+namespace {
+constexpr size_t QUEUE_JOBS_PER_THREAD = 4;
+
+stpp::Result run_job(const stpp::Job& job)
+{
+    stpp::Result result;
+
+    // Files are mapped if possible and read otherwise
+    MappedFile mapped;
+    std::string buffer;
+    std::string_view input = job.Input;
+    if (!job.Path.empty()) {
+        if (mapped.open(job.Path)) {
+            input = mapped.view();
+        } else {
+            std::ifstream in(job.Path, std::ios::in | std::ios::binary);
+            if (!in) {
+                std::cerr << "Could not open " << job.Path << std::endl;
+                result.Failed = true;
+                return result;
+            }
+            std::ostringstream stream;
+            stream << in.rdbuf();
+            buffer = stream.str();
+            input  = buffer;
+        }
     }
 
-    Token current()
-    {
-        if (mPosition >= mTokens.size())
-            return Token{ TokenType::EOS, "" };
+    static const std::unordered_set<std::string> noTags;
+    stpp::SpanGenerator generator(input, job.Tags ? *job.Tags : noTags, job.Directives.get(), job.Providers.get());
+    stpp::Span span;
+    while (generator.next(span)) {
+        if (job.Output)
+            job.Output(span);
         else
-            return mTokens[mPosition];
+            result.Output.append(span.Data, span.Size);
     }
+    result.Failed = generator.failed();
+    return result;
+}
+} // namespace
 
-private:
-    static inline const char* tokenStr(TokenType type)
+struct stpp::JobQueue::Implementation {
+    Implementation(size_t threads, size_t capacity)
+        : Capacity(capacity)
+        , Pool(threads)
     {
-        switch (type) {
-        case TokenType::Tag:
-            return "Tag";
-        case TokenType::ParantheseOpen:
-            return "(";
-        case TokenType::ParantheseClose:
-            return ")";
-        case TokenType::And:
-            return "&&";
-        case TokenType::Or:
-            return "||";
-        case TokenType::Xor:
-            return "^";
-        case TokenType::Not:
-            return "!";
-        default:
-        case TokenType::EOS:
-            return "EOS";
+    }
+
+    // Exceptions of the job or its callback are handed to onError, or kept for wait() if there is none
+    bool enqueue(Job&& job, Callback&& callback, std::function<void(std::exception_ptr)>&& onError, bool block)
+    {
+        {
+            std::unique_lock<std::mutex> lock(Mutex);
+            if (block)
+                Completed.wait(lock, [this]() { return Pending < Capacity; });
+            else if (Pending >= Capacity)
+                return false;
+            ++Pending;
         }
+
+        // Tasks have to be copyable, the job is shared rather than copied with them
+        auto shared = std::make_shared<Job>(std::move(job));
+        Pool.submit([this, shared, callback = std::move(callback), onError = std::move(onError)]() {
+            Completion completion(*this);
+            try {
+                callback(run_job(*shared));
+            } catch (...) {
+                if (onError)
+                    onError(std::current_exception());
+                else
+                    completion.Error = std::current_exception();
+            }
+        });
+        return true;
     }
 
-    std::vector<Token> mTokens;
-    size_t mPosition;
+    // Marks a job as done however it ends
+    struct Completion {
+        explicit Completion(Implementation& queue)
+            : Queue(queue)
+        {
+        }
+
+        ~Completion()
+        {
+            {
+                std::lock_guard<std::mutex> lock(Queue.Mutex);
+                if (Error && !Queue.Error)
+                    Queue.Error = Error;
+                --Queue.Pending;
+            }
+            Queue.Completed.notify_all();
+        }
+
+        Implementation& Queue;
+        std::exception_ptr Error;
+    };
+
+    const size_t Capacity;
+    size_t Pending = 0;
+    std::exception_ptr Error; // First exception not handed to a future
+    mutable std::mutex Mutex;
+    std::condition_variable Completed;
+    ThreadPool Pool; // Last, such that the workers are stopped first
 };
 
-bool binary_condition(ExprLexer& lexer, const Context& ctx);
-bool primary_condition(ExprLexer& lexer, const Context& ctx)
+stpp::JobQueue::JobQueue(size_t threads, size_t capacity)
 {
-    if (lexer.current().Type == TokenType::ParantheseOpen) {
-        lexer.accept();
-        const bool a = binary_condition(lexer, ctx);
-        if (!lexer.accept(TokenType::ParantheseClose))
-            return false;
-        return a;
-    } else {
-        Token tag = lexer.current();
-        if (!lexer.accept(TokenType::Tag))
-            return false;
-        return ctx.Tags.count(tag.Tag) > 0;
-    }
+    if (threads == 0)
+        threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    if (capacity == 0)
+        capacity = threads * QUEUE_JOBS_PER_THREAD;
+    mImplementation = std::make_unique<Implementation>(threads, capacity);
 }
 
-bool unary_condition(ExprLexer& lexer, const Context& ctx)
+stpp::JobQueue::~JobQueue()
 {
-    if (lexer.current().Type == TokenType::Not) {
-        lexer.accept();
-        return !unary_condition(lexer, ctx);
-    } else {
-        return primary_condition(lexer, ctx);
-    }
+    std::unique_lock<std::mutex> lock(mImplementation->Mutex);
+    mImplementation->Completed.wait(lock, [this]() { return mImplementation->Pending == 0; });
 }
 
-bool binary_condition(ExprLexer& lexer, const Context& ctx)
+bool stpp::JobQueue::trySubmit(Job&& job, Callback callback)
 {
-    const bool a = unary_condition(lexer, ctx);
+    return mImplementation->enqueue(std::move(job), std::move(callback), nullptr, false);
+}
 
-    if (lexer.current().Type == TokenType::EOS || lexer.current().Type == TokenType::ParantheseClose) {
-        lexer.accept();
-        return a;
-    } else if (lexer.current().Type == TokenType::And) {
-        lexer.accept();
-        const bool b = binary_condition(lexer, ctx);
-        return a && b;
-    } else if (lexer.current().Type == TokenType::Or) {
-        lexer.accept();
-        const bool b = binary_condition(lexer, ctx);
-        return a || b;
-    } else if (lexer.current().Type == TokenType::Xor) {
-        lexer.accept();
-        const bool b = binary_condition(lexer, ctx);
-        return a ^ b;
-    } else {
-        return false; // TODO
-    }
+void stpp::JobQueue::submit(Job&& job, Callback callback)
+{
+    mImplementation->enqueue(std::move(job), std::move(callback), nullptr, true);
+}
+
+std::future<stpp::Result> stpp::JobQueue::submit(Job&& job)
+{
+    auto promise = std::make_shared<std::promise<Result>>();
+    auto future  = promise->get_future();
+    mImplementation->enqueue(
+        std::move(job), [promise](Result&& result) { promise->set_value(std::move(result)); },
+        [promise](std::exception_ptr error) { promise->set_exception(error); }, true);
+    return future;
+}
+
+void stpp::JobQueue::wait()
+{
+    std::unique_lock<std::mutex> lock(mImplementation->Mutex);
+    mImplementation->Completed.wait(lock, [this]() { return mImplementation->Pending == 0; });
+    if (mImplementation->Error)
+        std::rethrow_exception(std::exchange(mImplementation->Error, nullptr));
+}
+
+size_t stpp::JobQueue::pending() const
+{
+    std::lock_guard<std::mutex> lock(mImplementation->Mutex);
+    return mImplementation->Pending;
+}
+
+struct stpp::CompiledTemplate::Implementation {
+    TemplateView View;
+    std::unordered_map<std::string_view, uint32_t> TagIDs;
+    std::vector<uint32_t> TestedTags; // Tags tested by any condition, only these are computed by providers
+};
+
+stpp::CompiledTemplate::CompiledTemplate()
+    : mImplementation(std::make_unique<Implementation>())
+{
 }
 
-bool handle_condition(std::istream& in, const Context& ctx)
+stpp::CompiledTemplate::CompiledTemplate(CompiledTemplate&& other) noexcept = default;
+stpp::CompiledTemplate& stpp::CompiledTemplate::operator=(CompiledTemplate&& other) noexcept = default;
+stpp::CompiledTemplate::~CompiledTemplate()                                                      = default;
+
+bool stpp::CompiledTemplate::load(std::string_view data)
 {
-    ExprLexer lexer(in);
-    if (lexer.current().Type == TokenType::EOS) {
-        std::cerr << "Expected condition but got nothing" << std::endl;
+    auto loaded = std::make_unique<Implementation>();
+    if (!load_template(data, loaded->View))
         return false;
+
+    const TemplateView& view = loaded->View;
+    for (uint32_t i = 0; i < view.TagCount; ++i)
+        loaded->TagIDs.emplace(std::string_view(view.Pool + view.Tags[i].Offset, view.Tags[i].Size), i);
+
+    // Tags only set by #define or #undef never need their initial value
+    std::vector<bool> tested(view.TagCount, false);
+    for (uint32_t i = 0; i < view.OpCount; ++i) {
+        const TemplateOp& op = view.Ops[i];
+        if (op.Code != TemplateOpCode::If && op.Code != TemplateOpCode::Elif)
+            continue;
+        for (uint32_t j = op.A; j < op.A + op.B; ++j) {
+            if (static_cast<OpCode>(view.Instructions[j].Code) == OpCode::Test)
+                tested[view.Instructions[j].Tag] = true;
+        }
     }
-    return binary_condition(lexer, ctx);
-}
\ No newline at end of file
+    for (uint32_t i = 0; i < view.TagCount; ++i) {
+        if (tested[i])
+            loaded->TestedTags.push_back(i);
+    }
+    mImplementation = std::move(loaded);
+    return true;
+}
+
+std::vector<uint64_t> stpp::CompiledTemplate::tagBits(const std::unordered_set<std::string>& tags, const TagProviders* providers) const
+{
+    std::vector<uint64_t> words((mImplementation->View.TagCount + 63) / 64, 0);
+    for (const auto& tag : tags) {
+        const auto it = mImplementation->TagIDs.find(tag);
+        if (it != mImplementation->TagIDs.end())
+            words[it->second / 64] |= uint64_t(1) << (it->second % 64);
+    }
+
+    // Rendering may take any path, so every tested tag without a given value is computed
+    if (providers) {
+        const TemplateView& view = mImplementation->View;
+        for (const uint32_t id : mImplementation->TestedTags) {
+            const std::string_view tag(view.Pool + view.Tags[id].Offset, view.Tags[id].Size);
+            bool value;
+            if (!tags.count(std::string(tag)) && providers->resolve(tag, value) && value)
+                words[id / 64] |= uint64_t(1) << (id % 64);
+        }
+    }
+    return words;
+}
+
+bool stpp::CompiledTemplate::render(const std::vector<uint64_t>& tags, std::vector<Span>& spans) const
+{
+    return render_template(mImplementation->View, tags, [&](const char* data, size_t size) { spans.push_back(Span{ data, size }); });
+}
+
+bool stpp::CompiledTemplate::render(const std::vector<uint64_t>& tags, std::string& output) const
+{
+    return render_template(mImplementation->View, tags, [&](const char* data, size_t size) { output.append(data, size); });
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+// Library interface
+namespace stpp {
+// A piece of output, pointing either into the input or into an internal buffer
+struct Span {
+    const char* Data = nullptr;
+    size_t Size      = 0;
+};
+
+// An annotation line such as "#[export] ...", located in the output
+struct Annotation {
+    std::string Name;  // Without brackets
+    size_t Offset = 0; // Of the annotation in the output
+    size_t Length = 0; // Of the output line starting at the annotation, without the newline
+};
+
+// Called with the rest of the line whenever a custom directive is reached in an active block.
+// Anything appended to the output replaces the directive and its line. Returning false aborts preprocessing
+using DirectiveHandler = std::function<bool(std::string_view arguments, std::string& output)>;
+
+// Custom directives, dispatched by keyword. Registered handlers may be called from multiple threads at once
+class DirectiveRegistry {
+public:
+    DirectiveRegistry();
+    ~DirectiveRegistry();
+
+    // Returns false if the keyword is empty, longer than 16 characters or already taken, including the builtin directives
+    bool add(std::string_view keyword, DirectiveHandler handler);
+
+private:
+    friend class SpanGenerator;
+    struct Implementation;
+    std::unique_ptr<Implementation> mImplementation;
+};
+
+// Computes the value of a tag, e.g. by probing the environment
+using TagProvider = std::function<bool()>;
+
+// Tags computed on first reference by a condition instead of up front, so only tags an input actually needs are computed.
+// Every provider is called at most once, its value is cached and shared by all users of the registry
+class TagProviders {
+public:
+    TagProviders();
+    ~TagProviders();
+
+    // Returns false if the tag is empty or already has a provider. Providers have to be added before the registry is used
+    bool add(std::string_view tag, TagProvider provider);
+    // Returns false if the tag has no provider. Computes the value on first use, safe to call from multiple threads
+    bool resolve(std::string_view tag, bool& value) const;
+
+private:
+    struct Implementation;
+    std::unique_ptr<Implementation> mImplementation;
+};
+
+// Preprocesses an input held in memory on demand.
+// Every call to next() resumes the preprocessor until the next output span is available, so consumers may stop at any time.
+// Plain text spans point directly into the input, which has to outlive the generator. The same holds for the directives
+// and providers. Explicitly given tags are never computed by a provider.
+class SpanGenerator {
+public:
+    SpanGenerator(std::string_view input, const std::unordered_set<std::string>& tags, const DirectiveRegistry* directives = nullptr,
+                  const TagProviders* providers = nullptr);
+    SpanGenerator(SpanGenerator&& other) noexcept;
+    SpanGenerator& operator=(SpanGenerator&& other) noexcept;
+    ~SpanGenerator();
+
+    // Returns false at the end of the input or on errors. The span is only valid until the next call
+    bool next(Span& span);
+    // True if preprocessing stopped due to an error. Diagnostics are written to std::cerr
+    bool failed() const;
+    // Annotations output so far. The length of the last ones is only known once their line is complete
+    const std::vector<Annotation>& annotations() const;
+
+private:
+    struct Implementation;
+    std::unique_ptr<Implementation> mImplementation;
+};
+
+// Template compiled by "stpp --compile", rendered for any set of tags without preprocessing the input again.
+// The artifact is used in place, so it has to outlive the template. Usually it is simply mapped.
+class CompiledTemplate {
+public:
+    CompiledTemplate();
+    CompiledTemplate(CompiledTemplate&& other) noexcept;
+    CompiledTemplate& operator=(CompiledTemplate&& other) noexcept;
+    ~CompiledTemplate();
+
+    // Returns false if the data is no valid artifact or not aligned to four bytes, in which case the template is left untouched
+    bool load(std::string_view data);
+
+    // Bitset of the given tags, indexed like the tag table of the template. Tags never referenced by the template are dropped,
+    // tags tested by a condition are computed by their provider if there is one. Tags only defined or undefined are never computed
+    std::vector<uint64_t> tagBits(const std::unordered_set<std::string>& tags, const TagProviders* providers = nullptr) const;
+
+    // Appends the output, either as spans pointing into the artifact, ready for writev(), or copied into a buffer.
+    // Returns false if preprocessing fails for these tags, the output up to the failure is still appended
+    bool render(const std::vector<uint64_t>& tags, std::vector<Span>& spans) const;
+    bool render(const std::vector<uint64_t>& tags, std::string& output) const;
+
+private:
+    struct Implementation;
+    std::unique_ptr<Implementation> mImplementation;
+};
+
+// Immutable set of active tags, shared between jobs
+using TagSetHandle = std::shared_ptr<const std::unordered_set<std::string>>;
+
+inline TagSetHandle make_tag_set(std::unordered_set<std::string> tags)
+{
+    return std::make_shared<const std::unordered_set<std::string>>(std::move(tags));
+}
+
+// Receives the output of a job on the worker thread
+using Sink = std::function<void(const Span&)>;
+
+struct Job {
+    std::string Input; // Used if no path is given
+    std::string Path;
+    TagSetHandle Tags;
+    std::shared_ptr<const DirectiveRegistry> Directives; // Optional
+    std::shared_ptr<const TagProviders> Providers;       // Optional
+    Sink Output;                                         // Output is collected into the result if not set
+};
+
+struct Result {
+    bool Failed = false;
+    std::string Output; // Empty if the job has a sink
+};
+
+// Preprocesses jobs on a pool of worker threads without blocking the submitting thread.
+// At most `capacity` jobs are queued or running at once, further submissions are rejected or wait for a job to complete.
+class JobQueue {
+public:
+    // Called on the worker thread once the job is done. Exceptions of the job or the callback are rethrown by wait()
+    using Callback = std::function<void(Result&&)>;
+
+    // Zero threads selects the hardware concurrency, zero capacity four jobs per thread
+    explicit JobQueue(size_t threads = 0, size_t capacity = 0);
+    // Completes all submitted jobs, pending exceptions are dropped
+    ~JobQueue();
+
+    // Returns false if the queue is full, in which case the job is left untouched
+    bool trySubmit(Job&& job, Callback callback);
+    // Blocks while the queue is full
+    void submit(Job&& job, Callback callback);
+    // Exceptions of the job are delivered through the future
+    std::future<Result> submit(Job&& job);
+
+    // Blocks until all submitted jobs are completed, then rethrows the first exception of a job or callback since the last wait
+    void wait();
+    // Jobs queued or running
+    size_t pending() const;
+
+private:
+    struct Implementation;
+    std::unique_ptr<Implementation> mImplementation;
+};
+} // namespace stpp
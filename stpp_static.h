@@ -0,0 +1,370 @@
+#pragma once
+
+#include <cstddef>
+#include <initializer_list>
+#include <iostream>
+#include <string_view>
+
+// Header only preprocessor running at compile time.
+// Mirrors the semantics of stpp for a single configuration, such that
+//     static constexpr auto page = stpp::preprocess_static(PAGE_TEMPLATE, { "RELEASE" });
+// is preprocessed entirely by the compiler. Errors stop compilation, malformed conditions are false without a diagnostic.
+namespace stpp {
+template <size_t Capacity>
+struct StaticOutput {
+    char Data[Capacity + 1] = {}; // Null terminated
+    size_t Size             = 0;
+    bool Failed             = false; // Only possible if evaluated at runtime
+
+    constexpr std::string_view view() const { return std::string_view(Data, Size); }
+    constexpr const char* c_str() const { return Data; }
+};
+
+namespace detail {
+constexpr size_t STATIC_MAX_OPERATION_SIZE = 16;
+constexpr size_t STATIC_MAX_TAGS           = 64;
+constexpr size_t STATIC_MAX_DEPTH          = 64;
+
+// Not constexpr on purpose: Reaching it during constant evaluation is a compile error showing the message
+inline void static_error(const char* message)
+{
+    std::cerr << message << std::endl;
+}
+
+constexpr bool static_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+enum class StaticToken {
+    Tag,
+    ParantheseOpen,
+    ParantheseClose,
+    And,
+    Or,
+    Xor,
+    Not,
+    EOS
+};
+
+constexpr StaticToken static_token(char c)
+{
+    switch (c) {
+    case '(':
+        return StaticToken::ParantheseOpen;
+    case ')':
+        return StaticToken::ParantheseClose;
+    case '&':
+        return StaticToken::And;
+    case '|':
+        return StaticToken::Or;
+    case '^':
+        return StaticToken::Xor;
+    case '!':
+        return StaticToken::Not;
+    default:
+        return static_is_space(c) ? StaticToken::EOS : StaticToken::Tag;
+    }
+}
+
+class StaticTagSet {
+public:
+    constexpr bool test(std::string_view tag) const
+    {
+        for (size_t i = 0; i < mSize; ++i) {
+            if (mTags[i] == tag)
+                return true;
+        }
+        return false;
+    }
+
+    constexpr bool set(std::string_view tag)
+    {
+        if (test(tag))
+            return true;
+        if (mSize == STATIC_MAX_TAGS)
+            return false;
+        mTags[mSize++] = tag;
+        return true;
+    }
+
+    constexpr void reset(std::string_view tag)
+    {
+        for (size_t i = 0; i < mSize; ++i) {
+            if (mTags[i] == tag) {
+                mTags[i] = mTags[--mSize];
+                return;
+            }
+        }
+    }
+
+private:
+    std::string_view mTags[STATIC_MAX_TAGS] = {};
+    size_t mSize                            = 0;
+};
+
+// Tokens are lexed on demand, as there is no storage for a token list at compile time
+class StaticLexer {
+public:
+    constexpr StaticLexer(std::string_view expr)
+        : mExpr(expr)
+    {
+        skip();
+    }
+
+    constexpr StaticToken current() const
+    {
+        return mPos < mExpr.size() ? static_token(mExpr[mPos]) : StaticToken::EOS;
+    }
+
+    constexpr std::string_view tag() const
+    {
+        size_t end = mPos;
+        while (end < mExpr.size() && static_token(mExpr[end]) == StaticToken::Tag)
+            ++end;
+        return mExpr.substr(mPos, end - mPos);
+    }
+
+    constexpr bool accept(StaticToken type)
+    {
+        const bool good = current() == type;
+        accept();
+        return good;
+    }
+
+    constexpr void accept()
+    {
+        switch (current()) {
+        case StaticToken::EOS:
+            return;
+        case StaticToken::Tag:
+            mPos += tag().size();
+            break;
+        case StaticToken::And:
+        case StaticToken::Or:
+            if (mPos + 1 < mExpr.size() && mExpr[mPos + 1] == mExpr[mPos])
+                ++mPos;
+            ++mPos;
+            break;
+        default:
+            ++mPos;
+            break;
+        }
+        skip();
+    }
+
+private:
+    constexpr void skip()
+    {
+        while (mPos < mExpr.size() && static_is_space(mExpr[mPos]))
+            ++mPos;
+    }
+
+    std::string_view mExpr;
+    size_t mPos = 0;
+};
+
+// Same grammar as binary_condition(), unary_condition() and primary_condition() of stpp
+constexpr bool static_binary_condition(StaticLexer& lexer, const StaticTagSet& tags);
+constexpr bool static_primary_condition(StaticLexer& lexer, const StaticTagSet& tags)
+{
+    if (lexer.current() == StaticToken::ParantheseOpen) {
+        lexer.accept();
+        const bool value = static_binary_condition(lexer, tags);
+        return lexer.accept(StaticToken::ParantheseClose) && value;
+    } else {
+        const std::string_view tag = lexer.current() == StaticToken::Tag ? lexer.tag() : std::string_view();
+        if (!lexer.accept(StaticToken::Tag))
+            return false;
+        return tags.test(tag);
+    }
+}
+
+constexpr bool static_unary_condition(StaticLexer& lexer, const StaticTagSet& tags)
+{
+    if (lexer.current() == StaticToken::Not) {
+        lexer.accept();
+        return !static_unary_condition(lexer, tags);
+    } else {
+        return static_primary_condition(lexer, tags);
+    }
+}
+
+constexpr bool static_binary_condition(StaticLexer& lexer, const StaticTagSet& tags)
+{
+    const bool left = static_unary_condition(lexer, tags);
+
+    const StaticToken op = lexer.current();
+    if (op == StaticToken::EOS || op == StaticToken::ParantheseClose) {
+        lexer.accept();
+        return left;
+    } else if (op == StaticToken::And || op == StaticToken::Or || op == StaticToken::Xor) {
+        lexer.accept();
+        const bool right = static_binary_condition(lexer, tags);
+        return op == StaticToken::And ? left && right : (op == StaticToken::Or ? left || right : left != right);
+    } else {
+        return false;
+    }
+}
+
+class StaticEngine {
+public:
+    constexpr StaticEngine(std::string_view input, std::initializer_list<std::string_view> tags)
+        : mInput(input)
+    {
+        for (const auto& tag : tags) {
+            if (!mTags.set(tag))
+                mFailed = !fail("Too many tags for compile time preprocessing");
+        }
+    }
+
+    template <size_t Capacity>
+    constexpr bool run(StaticOutput<Capacity>& output)
+    {
+        if (mFailed)
+            return false;
+
+        while (mPos < mInput.size()) {
+            const char c = mInput[mPos++];
+            if (c != '#') {
+                if (active() && !put(output, c))
+                    return false;
+                continue;
+            }
+
+            const std::string_view name = operation();
+            if (name == "if") {
+                const bool active    = this->active();
+                const bool condition = active && evaluate();
+                if (mDepth == STATIC_MAX_DEPTH)
+                    return fail("Blocks are nested too deep for compile time preprocessing");
+                mBlocks[mDepth++] = Block{ active, condition, false };
+            } else if (mDepth > 0 && (name == "elif" || name == "else" || name == "endif")) {
+                Block& block = mBlocks[mDepth - 1];
+                if (name == "endif") {
+                    --mDepth;
+                    continue;
+                }
+
+                block.OnceTrue  = block.OnceTrue || block.Condition;
+                block.Condition = false;
+                if (name == "elif" && !block.OnceTrue)
+                    block.Condition = evaluate();
+                else if (name == "else")
+                    block.Condition = !block.OnceTrue;
+            } else if (name == "define" || name == "undef") {
+                if (!active())
+                    continue;
+
+                const std::string_view tag = word();
+                if (tag.empty())
+                    return fail(name == "define" ? "Define statement without tag" : "Undef statement without tag");
+                if (name == "undef")
+                    mTags.reset(tag);
+                else if (!mTags.set(tag))
+                    return fail("Too many tags for compile time preprocessing");
+            } else if (active()) {
+                if (!put(output, '#'))
+                    return false;
+                for (const char n : name) {
+                    if (!put(output, n))
+                        return false;
+                }
+            }
+        }
+
+        if (mDepth > 0)
+            return fail("Missing #endif at end of input");
+        return true;
+    }
+
+private:
+    struct Block {
+        bool Active    = false; // Around the block
+        bool Condition = false;
+        bool OnceTrue  = false;
+    };
+
+    constexpr bool active() const
+    {
+        if (mDepth == 0)
+            return true;
+        const Block& block = mBlocks[mDepth - 1];
+        return block.Active && !block.OnceTrue && block.Condition;
+    }
+
+    constexpr bool fail(const char* message)
+    {
+        return message ? (static_error(message), false) : false;
+    }
+
+    template <size_t Capacity>
+    constexpr bool put(StaticOutput<Capacity>& output, char c)
+    {
+        if (output.Size == Capacity)
+            return fail("Output exceeds the capacity");
+        output.Data[output.Size++] = c;
+        return true;
+    }
+
+    // Same as extract_operation() and get_tag() of stpp
+    constexpr std::string_view readWord(size_t maxSize)
+    {
+        size_t start = mPos;
+        size_t size  = 0;
+        bool started = false;
+        while (size < maxSize && mPos < mInput.size()) {
+            const char c = mInput[mPos++];
+            if (c == '\n')
+                break;
+            if (!static_is_space(c)) {
+                if (!started)
+                    start = mPos - 1;
+                ++size;
+                started = true;
+            } else if (started) {
+                break;
+            }
+        }
+        return mInput.substr(start, size);
+    }
+
+    constexpr std::string_view operation() { return readWord(STATIC_MAX_OPERATION_SIZE); }
+    constexpr std::string_view word() { return readWord(mInput.size()); }
+
+    constexpr bool evaluate()
+    {
+        const size_t end = mInput.find('\n', mPos);
+        StaticLexer lexer(mInput.substr(mPos, end == std::string_view::npos ? std::string_view::npos : end - mPos));
+        mPos = end == std::string_view::npos ? mInput.size() : end + 1;
+
+        if (lexer.current() == StaticToken::EOS)
+            return false;
+        return static_binary_condition(lexer, mTags);
+    }
+
+    std::string_view mInput;
+    size_t mPos    = 0;
+    bool mFailed   = false;
+    StaticTagSet mTags;
+    Block mBlocks[STATIC_MAX_DEPTH] = {};
+    size_t mDepth                   = 0;
+};
+} // namespace detail
+
+// The output is never larger than the input
+template <size_t Capacity>
+constexpr StaticOutput<Capacity> preprocess_static(std::string_view input, std::initializer_list<std::string_view> tags = {})
+{
+    StaticOutput<Capacity> output;
+    detail::StaticEngine engine(input, tags);
+    output.Failed = !engine.run(output);
+    return output;
+}
+
+template <size_t N>
+constexpr StaticOutput<N - 1> preprocess_static(const char (&input)[N], std::initializer_list<std::string_view> tags = {})
+{
+    return preprocess_static<N - 1>(std::string_view(input, N - 1), tags);
+}
+} // namespace stpp
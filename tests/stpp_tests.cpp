@@ -0,0 +1,677 @@
+// Tests of the internals, which are visible as the sources are part of this translation unit
+#include "../stpp.cpp"
+#include "../stpp_static.h"
+
+namespace {
+size_t failures = 0;
+std::streambuf* const checkOutput = std::cerr.rdbuf(); // Failed checks are reported here, even while errors are silenced
+
+#define CHECK(condition, message)                                                                  \
+    do {                                                                                           \
+        if (!(condition)) {                                                                        \
+            std::ostream out(checkOutput);                                                         \
+            out << __FILE__ << ":" << __LINE__ << ": " << message << std::endl;                    \
+            ++failures;                                                                            \
+        }                                                                                          \
+    } while (false)
+
+// Collects the diagnostics of the code under test instead of printing them while in scope
+class SilencedErrors {
+public:
+    SilencedErrors()
+        : mErrors(std::cerr.rdbuf(mDiagnostics.rdbuf()))
+    {
+    }
+
+    SilencedErrors(const SilencedErrors&) = delete;
+    SilencedErrors& operator=(const SilencedErrors&) = delete;
+
+    ~SilencedErrors() { std::cerr.rdbuf(mErrors); }
+
+    inline std::string diagnostics() const { return mDiagnostics.str(); }
+
+private:
+    std::ostringstream mDiagnostics;
+    std::streambuf* mErrors;
+};
+
+// Immediate evaluation as stpp did before conditions were compiled, the reference for the compiled programs
+bool reference_binary(ExprLexer& lexer, const std::unordered_set<std::string>& tags);
+bool reference_primary(ExprLexer& lexer, const std::unordered_set<std::string>& tags)
+{
+    if (lexer.current().Type == TokenType::ParantheseOpen) {
+        lexer.accept();
+        const bool a = reference_binary(lexer, tags);
+        if (!lexer.accept(TokenType::ParantheseClose))
+            return false;
+        return a;
+    } else {
+        Token tag = lexer.current();
+        if (!lexer.accept(TokenType::Tag))
+            return false;
+        return tags.count(std::string(tag.Tag)) > 0;
+    }
+}
+
+bool reference_unary(ExprLexer& lexer, const std::unordered_set<std::string>& tags)
+{
+    if (lexer.current().Type == TokenType::Not) {
+        lexer.accept();
+        return !reference_unary(lexer, tags);
+    }
+    return reference_primary(lexer, tags);
+}
+
+bool reference_binary(ExprLexer& lexer, const std::unordered_set<std::string>& tags)
+{
+    const bool a = reference_unary(lexer, tags);
+    switch (lexer.current().Type) {
+    case TokenType::EOS:
+    case TokenType::ParantheseClose:
+        lexer.accept();
+        return a;
+    case TokenType::And: {
+        lexer.accept();
+        const bool b = reference_binary(lexer, tags);
+        return a && b;
+    }
+    case TokenType::Or: {
+        lexer.accept();
+        const bool b = reference_binary(lexer, tags);
+        return a || b;
+    }
+    case TokenType::Xor: {
+        lexer.accept();
+        const bool b = reference_binary(lexer, tags);
+        return a ^ b;
+    }
+    default:
+        return false;
+    }
+}
+
+bool reference_condition(const std::string& expr, const std::unordered_set<std::string>& tags)
+{
+    ExprLexer lexer(expr, false);
+    return lexer.current().Type != TokenType::EOS && reference_binary(lexer, tags);
+}
+
+// Compiles with all tags given and the mutable ones left to evaluation, as preprocessing does
+bool compiled_condition(const std::string& expr, const std::unordered_set<std::string>& tags, const std::unordered_set<std::string>& mutableTags, bool fold)
+{
+    Context ctx;
+    ctx.Tags.resize(1);
+    for (const auto& tag : tags)
+        ctx.Tags[0].set(ctx.Table.intern(tag));
+    if (fold)
+        fold_tags(ctx, mutableTags);
+
+    CompiledCondition cond;
+    ExprLexer lexer(expr, false);
+    if (lexer.current().Type == TokenType::EOS)
+        cond.emitConstant(false);
+    else
+        binary_condition(lexer, ctx, cond);
+    return cond.evaluate(ctx.Tags[0]);
+}
+
+void test_condition_samples()
+{
+    SilencedErrors silenced;
+    const std::unordered_set<std::string> a = { "A" };
+    CHECK(!compiled_condition("(A", a, {}, false), "Unclosed parantheses are false");
+    CHECK(!compiled_condition("(A", a, {}, true), "Unclosed parantheses are false when folded");
+    CHECK(compiled_condition("!B && A", a, {}, true), "!B && A is true");
+    CHECK(!compiled_condition("A B", a, {}, false), "Missing operators are false");
+    CHECK(!compiled_condition("", a, {}, false), "Empty conditions are false");
+    CHECK(compiled_condition("A)", a, {}, false), "A closing paranthesis ends the condition");
+}
+
+void test_condition_differential()
+{
+    static const char* TOKENS[] = { "A", "B", "C", "D", "(", ")", "&&", "||", "^", "!", "&", "|", " " };
+    std::mt19937 random(1234);
+    std::uniform_int_distribution<size_t> token(0, sizeof(TOKENS) / sizeof(TOKENS[0]) - 1);
+    std::uniform_int_distribution<size_t> length(0, 12);
+    std::uniform_int_distribution<int> bits(0, 15);
+
+    // Parse errors of malformed expressions are reported all the time
+    SilencedErrors silenced;
+
+    for (size_t i = 0; i < 20000; ++i) {
+        std::string expr;
+        const size_t size = length(random);
+        for (size_t j = 0; j < size; ++j)
+            expr += std::string(TOKENS[token(random)]) + " ";
+
+        std::unordered_set<std::string> tags;
+        std::unordered_set<std::string> mutableTags;
+        const int set = bits(random), changing = bits(random);
+        for (int t = 0; t < 4; ++t) {
+            if (set & (1 << t))
+                tags.insert(std::string(1, char('A' + t)));
+            if (changing & (1 << t))
+                mutableTags.insert(std::string(1, char('A' + t)));
+        }
+
+        const bool expected = reference_condition(expr, tags);
+        const bool compiled = compiled_condition(expr, tags, mutableTags, false);
+        const bool folded   = compiled_condition(expr, tags, mutableTags, true);
+        CHECK(compiled == expected, "Compiled '" << expr << "' differs from the reference");
+        CHECK(folded == expected, "Folded '" << expr << "' differs from the reference");
+    }
+}
+
+std::string preprocess(std::string_view input, const std::unordered_set<std::string>& tags)
+{
+    stpp::SpanGenerator generator(input, tags);
+    std::string output;
+    stpp::Span span;
+    while (generator.next(span))
+        output.append(span.Data, span.Size);
+    return output;
+}
+
+// Tags of a #define or #undef ending its line are on the next line, they must never be folded
+void test_directive_index()
+{
+    const std::string input = "#if FOO\none\n#endif\n#undef\nFOO\n#if FOO\ntwo\n#endif\n";
+    CHECK(preprocess(input, { "FOO" }) == "one\n", "Tag of #undef on the next line is folded");
+
+    std::unordered_set<std::string> mutableTags;
+    std::unordered_set<std::string> conditionTags;
+    scan_directives(std::string_view("#define\n  BAR baz\n#if\nA || B\n"), mutableTags, &conditionTags);
+    CHECK(mutableTags == std::unordered_set<std::string>({ "BAR" }), "Memory scan misses tags on the next line");
+    CHECK(conditionTags == std::unordered_set<std::string>({ "A", "B" }), "Memory scan misses conditions on the next line");
+
+    std::istringstream stream("#undef\nFOO\n");
+    mutableTags.clear();
+    CHECK(scan_directives(stream, mutableTags, nullptr) && mutableTags.count("FOO"), "Stream scan misses tags on the next line");
+}
+std::string tar_header(const char* name, uint64_t size)
+{
+    std::string header(TAR_BLOCK_SIZE, '\0');
+    std::memcpy(&header[0], name, strlen(name));
+    std::memcpy(&header[TAR_MAGIC_OFFSET], "ustar", 6);
+    header[TAR_TYPE_OFFSET] = '0';
+    tar_write_number(&header[TAR_SIZE_OFFSET], TAR_SIZE_LENGTH, size);
+    tar_update_checksum(&header[0]);
+    return header;
+}
+
+bool read_tar(const std::string& archive)
+{
+    std::istringstream in(archive);
+    TarEntry entry;
+    bool end = false;
+    return read_tar_entry(in, entry, end) && entry.Data.size() == tar_read_number(&archive[TAR_SIZE_OFFSET], TAR_SIZE_LENGTH);
+}
+
+// Headers are validated before their size is trusted
+void test_tar_headers()
+{
+    SilencedErrors silenced;
+    const std::string valid = tar_header("a.txt", 5) + "hello" + std::string(TAR_BLOCK_SIZE - 5, '\0');
+    std::string corrupt     = valid;
+    corrupt[0]              = 'b';
+    std::string noMagic     = valid;
+    std::memset(&noMagic[TAR_MAGIC_OFFSET], 0, 6);
+    const std::string huge = tar_header("a.txt", 077777777777) + "hello";
+
+    const bool readValid   = read_tar(valid);
+    const bool readCorrupt = read_tar(corrupt);
+    const bool readNoMagic = read_tar(noMagic);
+    const bool readHuge    = read_tar(huge);
+    CHECK(readValid, "Valid tar entries are read");
+    CHECK(!readCorrupt, "Checksum mismatches are rejected");
+    CHECK(!readNoMagic, "Headers without ustar magic are rejected");
+    CHECK(!readHuge, "Sizes beyond the archive are rejected");
+}
+
+// Throwing jobs and callbacks complete their job and surface the exception
+void test_job_queue_exceptions()
+{
+    const auto throwingJob = []() {
+        stpp::Job job;
+        job.Input  = "text\n";
+        job.Output = [](const stpp::Span&) { throw std::runtime_error("sink"); };
+        return job;
+    };
+
+    stpp::JobQueue queue(2, 2);
+    for (int i = 0; i < 8; ++i) {
+        stpp::Job job;
+        job.Input = "text\n";
+        queue.submit(std::move(job), [](stpp::Result&&) { throw std::runtime_error("callback"); });
+    }
+    bool rethrown = false;
+    try {
+        queue.wait();
+    } catch (const std::runtime_error&) {
+        rethrown = true;
+    }
+    CHECK(rethrown, "wait() rethrows callback exceptions");
+    CHECK(queue.pending() == 0, "Jobs with throwing callbacks are completed");
+
+    auto future   = queue.submit(throwingJob());
+    bool received = false;
+    try {
+        future.get();
+    } catch (const std::runtime_error&) {
+        received = true;
+    }
+    CHECK(received, "Futures receive exceptions of their job");
+
+    queue.submit(throwingJob(), [](stpp::Result&&) {});
+    // Destruction completes the job and drops its exception
+}
+
+// Preprocesses with the given limits, returns false if they are exceeded
+bool preprocess_limited(std::string_view input, const Budget& limits, std::string& output)
+{
+    Context context;
+    context.Limits = limits;
+    MemorySource source(input);
+    Engine<MemorySource> engine(source, context);
+    OutputSpan span;
+    while (engine.next(span))
+        output.append(span.Data, span.Size);
+    return !engine.failed();
+}
+
+// Limits are enforced in plain text and while reading conditions, not only at directive boundaries
+void test_limits()
+{
+    SilencedErrors silenced;
+    Budget output;
+    output.Output = 8;
+    std::string text;
+    const bool textPassed = preprocess_limited("0123456789abcdef\n", output, text);
+    std::string small;
+    const bool smallPassed = preprocess_limited("0123456\n", output, small);
+
+    Budget expression;
+    expression.Expression = 8;
+    std::string condition;
+    const bool conditionPassed = preprocess_limited("#if AAAAAAAAAAAAAAAA\nx\n#endif\ntail\n", expression, condition);
+    std::string shortCondition;
+    const bool shortPassed = preprocess_limited("#if AAAA\nx\n#endif\n", expression, shortCondition);
+
+    CHECK(!textPassed && text.size() <= output.Output, "Text without directives is held to the output limit");
+    CHECK(smallPassed && small == "0123456\n", "Output within the limit is written");
+    CHECK(!conditionPassed && condition.empty(), "Long conditions are rejected");
+    CHECK(shortPassed && shortCondition.empty(), "Conditions within the limit are evaluated");
+}
+
+// Annotation names are not bound to the length of directive names
+void test_annotations()
+{
+    const std::string input = "#[a_very_long_annotation_name] x\n#[short] y\n#[unclosed name] z\n";
+    std::vector<stpp::Annotation> annotations;
+    Context context;
+    context.Annotations = &annotations;
+    MemorySource source(input);
+    Engine<MemorySource> engine(source, context);
+
+    SilencedErrors silenced;
+    std::string output;
+    OutputSpan span;
+    while (engine.next(span))
+        output.append(span.Data, span.Size);
+
+    CHECK(output == "#[a_very_long_annotation_name] x\n#[short]y\n#[unclosedname] z\n", "Annotations are echoed completely");
+    CHECK(annotations.size() == 2, "Closed annotations are collected");
+    CHECK(!annotations.empty() && annotations[0].Name == "a_very_long_annotation_name", "Long annotation names are kept");
+    CHECK(!silenced.diagnostics().empty(), "Unclosed annotations are reported");
+}
+
+// A benchmark fails if any of its runs fails, not only the first one
+void test_measure_failures()
+{
+    Options options;
+    options.BenchWarmup = 2;
+    options.BenchRuns   = 4;
+
+    SilencedErrors silenced;
+    BenchResult result;
+    std::vector<bool> outcomes;
+    for (size_t failing = 0; failing <= options.BenchWarmup + options.BenchRuns + 1; ++failing) {
+        size_t calls = 0;
+        outcomes.push_back(measure("test", options, [&]() { return calls++ != failing; }, result));
+    }
+
+    for (size_t i = 0; i + 1 < outcomes.size(); ++i)
+        CHECK(!outcomes[i], "Failure of run " << i << " is detected");
+    CHECK(outcomes.back() && result.Samples > 0, "Benchmarks without failures succeed");
+}
+
+// Artifacts are loaded from aligned storage like a mapping, offset misaligns them on purpose
+bool load_artifact(const std::string& artifact, size_t offset = 0)
+{
+    std::vector<uint64_t> storage((artifact.size() + offset) / sizeof(uint64_t) + 1);
+    char* data = reinterpret_cast<char*>(storage.data()) + offset;
+    std::memcpy(data, artifact.data(), artifact.size());
+    TemplateView view;
+    return load_template(std::string_view(data, artifact.size()), view);
+}
+
+// Applies change to an operation or instruction of the artifact in place
+template <typename Record, typename Change>
+std::string patch_artifact(std::string artifact, uint32_t index, Change change)
+{
+    TemplateHeader header;
+    std::memcpy(&header, artifact.data(), sizeof(header));
+    size_t offset = sizeof(header) + header.TagCount * sizeof(TemplateString) + index * sizeof(Record);
+    if (std::is_same<Record, TemplateInstruction>::value)
+        offset += header.OpCount * sizeof(TemplateOp);
+
+    Record record;
+    std::memcpy(&record, &artifact[offset], sizeof(record));
+    change(record, header);
+    std::memcpy(&artifact[offset], &record, sizeof(record));
+    return artifact;
+}
+
+// Rendering a compiled template gives the output and result of preprocessing the input
+void test_template_round_trip()
+{
+    static const char* LINES[] = { "#if A\n", "#if A && !B\n", "#if (B || C))\n", "#elif C ^ A\n", "#elif\nB\n", "#else\n", "#endif\n",
+                                   "#define B\n", "#undef A\n", "#define\nC\n", "#foo\n", "text\n", "x #if B\n", "no newline" };
+    std::mt19937 random(4321);
+    std::uniform_int_distribution<size_t> line(0, sizeof(LINES) / sizeof(LINES[0]) - 1);
+    std::uniform_int_distribution<size_t> length(0, 16);
+    std::uniform_int_distribution<int> bits(0, 7);
+
+    SilencedErrors silenced;
+    for (size_t i = 0; i < 2000; ++i) {
+        std::string input;
+        const size_t size = length(random);
+        for (size_t j = 0; j < size; ++j)
+            input += LINES[line(random)];
+
+        Options options;
+        const int set = bits(random);
+        for (int t = 0; t < 3; ++t) {
+            if (set & (1 << t))
+                options.Tags.insert(std::string(1, char('A' + t)));
+        }
+
+        std::ostringstream expected;
+        const bool parsed = parse(std::string_view(input), expected, options);
+
+        std::ostringstream artifact;
+        const bool compiled = compile(input, artifact);
+        CHECK(compiled, "'" << input << "' is compiled");
+
+        const std::string data = artifact.str();
+        std::vector<uint64_t> storage(data.size() / sizeof(uint64_t) + 1);
+        std::memcpy(storage.data(), data.data(), data.size());
+        stpp::CompiledTemplate compiledTemplate;
+        const bool loaded = compiledTemplate.load(std::string_view(reinterpret_cast<const char*>(storage.data()), data.size()));
+        CHECK(loaded, "Artifact of '" << input << "' is loaded");
+        if (!compiled || !loaded)
+            continue;
+
+        std::string output;
+        const bool rendered = compiledTemplate.render(compiledTemplate.tagBits(options.Tags), output);
+        CHECK(rendered == parsed, "Rendering '" << input << "' fails unlike preprocessing");
+        CHECK(!parsed || output == expected.str(), "Rendering '" << input << "' differs from preprocessing");
+    }
+}
+
+// Artifacts are validated before any offset or jump of them is trusted
+void test_template_validation()
+{
+    // Operations: if, text, elif, text, endif. Instructions: A, B, and, C
+    std::ostringstream out;
+    CHECK(compile("#if A && B\nx\n#elif C\ny\n#endif\n", out), "Template is compiled");
+    const std::string artifact = out.str();
+    CHECK(load_artifact(artifact), "Valid artifacts are loaded");
+
+    CHECK(!load_artifact(artifact.substr(0, artifact.size() - 1)), "Truncated artifacts are rejected");
+    CHECK(!load_artifact(artifact.substr(0, sizeof(TemplateHeader) - 1)), "Truncated headers are rejected");
+    CHECK(!load_artifact(artifact + '\0'), "Trailing data is rejected");
+    CHECK(!load_artifact(artifact, 1), "Misaligned artifacts are rejected");
+
+    const auto jump = [&](uint32_t index, bool next, uint32_t target) {
+        return patch_artifact<TemplateOp>(artifact, index, [&](TemplateOp& op, const TemplateHeader&) { (next ? op.Next : op.End) = target; });
+    };
+    CHECK(!load_artifact(jump(0, true, 0)), "Branches to themselves are rejected");
+    CHECK(!load_artifact(jump(2, true, 0)), "Branches backwards are rejected");
+    CHECK(!load_artifact(jump(2, false, 1)), "Ends backwards are rejected");
+    CHECK(!load_artifact(jump(0, true, 5)), "Branches beyond the operations are rejected");
+    CHECK(!load_artifact(jump(0, false, UINT32_MAX)), "Ends beyond the operations are rejected");
+    CHECK(!load_artifact(jump(0, true, 1)), "Branches to text are rejected");
+
+    const auto instruction = [&](uint32_t index, OpCode code) {
+        return patch_artifact<TemplateInstruction>(artifact, index, [&](TemplateInstruction& ins, const TemplateHeader&) { ins.Code = static_cast<uint32_t>(code); });
+    };
+    CHECK(load_artifact(instruction(1, OpCode::True)), "Programs keeping their stack are loaded");
+    CHECK(!load_artifact(instruction(0, OpCode::And)), "Binary operations without operands are rejected");
+    CHECK(!load_artifact(instruction(3, OpCode::Not)), "Unary operations without operand are rejected");
+    CHECK(!load_artifact(instruction(3, static_cast<OpCode>(0xff))), "Unknown instructions are rejected");
+    CHECK(!load_artifact(patch_artifact<TemplateInstruction>(artifact, 0, [](TemplateInstruction& ins, const TemplateHeader& header) { ins.Tag = header.TagCount; })),
+          "Tests of unknown tags are rejected");
+    CHECK(!load_artifact(patch_artifact<TemplateOp>(artifact, 2, [](TemplateOp& op, const TemplateHeader& header) { op.A = header.InstructionCount; })),
+          "Programs beyond the instructions are rejected");
+    CHECK(!load_artifact(patch_artifact<TemplateOp>(artifact, 1, [](TemplateOp& op, const TemplateHeader& header) { op.B = header.PoolSize - op.A + 1; })),
+          "Text beyond the pool is rejected");
+}
+
+// Providers are only asked for tags some condition tests and no value is given for
+void test_template_providers()
+{
+    std::ostringstream out;
+    CHECK(compile("#define D\n#undef U\n#if A || B\nx\n#endif\n#if D\ny\n#endif\n", out), "Template is compiled");
+    const std::string artifact = out.str();
+    std::vector<uint64_t> storage(artifact.size() / sizeof(uint64_t) + 1);
+    std::memcpy(storage.data(), artifact.data(), artifact.size());
+    stpp::CompiledTemplate compiledTemplate;
+    CHECK(compiledTemplate.load(std::string_view(reinterpret_cast<const char*>(storage.data()), artifact.size())), "Template is loaded");
+
+    std::set<std::string> called;
+    stpp::TagProviders providers;
+    for (const char* tag : { "A", "B", "D", "U" })
+        providers.add(tag, [&called, tag]() { return called.insert(tag), true; });
+
+    std::string output;
+    CHECK(compiledTemplate.render(compiledTemplate.tagBits({ "B" }, &providers), output) && output == "x\ny\n", "Provided tags are rendered");
+    CHECK(called == std::set<std::string>({ "A", "D" }), "Only tested tags without a given value are computed");
+}
+
+// Preprocessing at compile time gives the same output as the runtime engine, both are held to the expected output with A set
+struct StaticCase {
+    const char* Input;
+    const char* Output;
+};
+
+constexpr StaticCase STATIC_CASES[] = {
+    { "#if A\none\n#elif A\ntwo\n#else\nthree\n#endif\n", "one\n" }, // Elif after a taken branch
+    { "#if B\none\n#elif A\ntwo\n#elif A\nthree\n#endif\n", "two\n" },
+    { "#if\nA\nx\n#endif\n", "x\n" }, // Directives ending their line
+    { "#define\nB\n#if B\ny\n#endif\n", "y\n" },
+    { "a #foo bar\n#foo\nz\n", "a #foobar\n#fooz\n" }, // Unknown directives
+    { "#elif A\n#else\n#endif\n", "#elifA\n#else#endif" },
+    { "#if (A\nx\n#endif\n", "" }, // Malformed conditions
+    { "#if A B\nx\n#endif\n", "" },
+    { "#if (A)\nx\n#endif\n", "" },
+    { "#if A &&\nx\n#endif\n", "" },
+    { "#if A)\nx\n#endif\n", "x\n" },
+    { "#if !A\nx\n#elif (A\ny\n#else\nz\n#endif\n", "z\n" },
+};
+
+constexpr bool static_matches(const StaticCase& sample)
+{
+    const auto output = stpp::preprocess_static<64>(sample.Input, { "A" });
+    return !output.Failed && output.view() == sample.Output;
+}
+
+static_assert(static_matches(STATIC_CASES[0]), "Elif after a taken branch is skipped");
+static_assert(static_matches(STATIC_CASES[1]), "First true elif is taken");
+static_assert(static_matches(STATIC_CASES[2]), "Conditions of a directive ending its line are on the next line");
+static_assert(static_matches(STATIC_CASES[3]), "Tags of a directive ending its line are on the next line");
+static_assert(static_matches(STATIC_CASES[4]), "Unknown directives are echoed");
+static_assert(static_matches(STATIC_CASES[5]), "Branches outside of blocks are echoed");
+static_assert(static_matches(STATIC_CASES[6]), "Unclosed parantheses are false");
+static_assert(static_matches(STATIC_CASES[7]), "Missing operators are false");
+static_assert(static_matches(STATIC_CASES[8]), "Groups ending the condition are false");
+static_assert(static_matches(STATIC_CASES[9]), "Missing operands are false");
+static_assert(static_matches(STATIC_CASES[10]), "A closing paranthesis ends the condition");
+static_assert(static_matches(STATIC_CASES[11]), "Malformed elif conditions are false");
+
+void test_static_preprocessing()
+{
+    SilencedErrors silenced;
+    for (const StaticCase& sample : STATIC_CASES)
+        CHECK(preprocess(sample.Input, { "A" }) == sample.Output, "Runtime output of '" << sample.Input << "' differs from compile time");
+}
+
+// Applies a zero context unified diff like patch does, returns false if a hunk does not match the original
+bool apply_diff(const std::string& original, const std::string& diff, std::string& patched)
+{
+    std::vector<std::string> lines;
+    for (size_t start = 0; start < original.size();) {
+        const size_t end = std::min(original.find('\n', start), original.size() - 1);
+        lines.push_back(original.substr(start, end - start + 1));
+        start = end + 1;
+    }
+
+    size_t pos = 0;
+    std::vector<std::string> removed;
+    std::vector<std::string> added;
+    std::vector<std::string>* last = nullptr;
+    const auto applyHunk = [&]() {
+        for (const std::string& line : removed) {
+            if (pos >= lines.size() || lines[pos++] != line)
+                return false;
+        }
+        for (const std::string& line : added)
+            patched += line;
+        removed.clear();
+        added.clear();
+        return true;
+    };
+
+    std::istringstream in(diff);
+    std::string line;
+    bool inHunk = false;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 2, "@@") == 0) {
+            size_t start[2], count[2];
+            if (!applyHunk() || std::sscanf(line.c_str(), "@@ -%zu,%zu +%zu,%zu @@", &start[0], &count[0], &start[1], &count[1]) != 4)
+                return false;
+            // An empty side refers to the line before the hunk
+            const size_t target = count[0] > 0 ? start[0] - 1 : start[0];
+            if (target < pos || target > lines.size())
+                return false;
+            for (; pos < target; ++pos)
+                patched += lines[pos];
+            inHunk = true;
+        } else if (inHunk && (line[0] == '-' || line[0] == '+')) {
+            last = line[0] == '-' ? &removed : &added;
+            last->push_back(line.substr(1) + "\n");
+        } else if (inHunk && line[0] == '\\' && last && !last->empty()) {
+            last->back().pop_back();
+        } else if (inHunk) {
+            return false;
+        }
+    }
+    if (!applyHunk())
+        return false;
+    for (; pos < lines.size(); ++pos)
+        patched += lines[pos];
+    return true;
+}
+
+// Patching the output of the first configuration with the diff gives the output of the second one
+void test_diff_output()
+{
+    const auto check = [](const std::string& input) {
+        Options options;
+        options.Mode        = RunMode::Diff;
+        options.Tags        = { "A" };
+        options.AgainstTags = { "B" };
+        std::ostringstream diff;
+        const bool diffed = parse(std::string_view(input), diff, options);
+
+        options.Mode = RunMode::Preprocess;
+        std::ostringstream first;
+        parse(std::string_view(input), first, options);
+        options.Tags = options.AgainstTags;
+        std::ostringstream second;
+        const bool parsed = parse(std::string_view(input), second, options);
+
+        std::string patched;
+        CHECK(diffed == parsed, "Diffing '" << input << "' fails unlike preprocessing");
+        CHECK(apply_diff(first.str(), diff.str(), patched), "Diff of '" << input << "' does not apply:\n" << diff.str());
+        CHECK(patched == second.str(), "Diff of '" << input << "' gives '" << patched << "' instead of '" << second.str() << "'");
+    };
+
+    check("#if A\nx\n#else\ny#endif\nz\n");    // Newlines out of sync
+    check("a\n#if A\nb\n#endif\nc");           // Missing newline at the end of both
+    check("a\n#if A\nb\n#else\nb\nc#endif\n"); // Missing newline at the end of one
+    check("#if A\nfirst\nonly\n#endif\n");     // Second side empty
+    check("#if B\nsecond\nonly\n#endif\n");    // First side empty
+    check("#if B\nsecond#endif\n");            // First side empty, second without newline
+    check("same\n#if A\n1\n#endif\nsame\n#if B\n2\n#endif\nsame\n");
+
+    static const char* PARTS[] = { "#if A\n", "#if B\n", "#if A ^ B\n", "#else\n", "#endif\n", "x", "y\n", "\n", "z\nw\n" };
+    std::mt19937 random(2024);
+    std::uniform_int_distribution<size_t> part(0, sizeof(PARTS) / sizeof(PARTS[0]) - 1);
+    std::uniform_int_distribution<size_t> length(0, 24);
+    for (size_t i = 0; i < 2000; ++i) {
+        std::string input;
+        size_t depth      = 0;
+        const size_t size = length(random);
+        for (size_t j = 0; j < size; ++j) {
+            const std::string next = PARTS[part(random)];
+            if (next == "#else\n" || next == "#endif\n") {
+                if (depth == 0)
+                    continue;
+                depth -= next == "#endif\n";
+            } else if (next[0] == '#') {
+                ++depth;
+            }
+            input += next;
+        }
+        for (; depth > 0; --depth)
+            input += "#endif\n";
+        check(input);
+    }
+}
+
+// Only strings exceeding the inline buffer are accounted
+void test_string_usage()
+{
+    std::string empty;
+    std::string full(std::string().capacity(), 'x');
+    std::string heap(std::string().capacity() + 1, 'x');
+    CHECK(string_usage(empty) == 0, "Empty strings use no heap");
+    CHECK(string_usage(full) == 0, "Strings filling the inline buffer use no heap");
+    CHECK(string_usage(heap) == heap.capacity() + 1, "Longer strings use their capacity and the terminator");
+}
+} // namespace
+
+int main()
+{
+    test_condition_samples();
+    test_condition_differential();
+    test_directive_index();
+    test_tar_headers();
+    test_job_queue_exceptions();
+    test_string_usage();
+    test_limits();
+    test_annotations();
+    test_measure_failures();
+    test_template_round_trip();
+    test_template_validation();
+    test_template_providers();
+    test_static_preprocessing();
+    test_diff_output();
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}